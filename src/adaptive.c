@@ -0,0 +1,102 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// adaptive.c: This file contains a polling policy that lowers the
+//             read rate while the engine is stopped or its state is
+//             steady, and returns to the full rate as soon as it
+//             changes.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Prepares an adaptive polling policy with default thresholds. The
+ * thresholds and slow rates may be changed before the first update.
+ * @param policy Policy state
+ * @param rate_max Rate used while the engine state is changing, in reads
+ *   per second (0 for as fast as possible)
+ */
+void mems_adaptive_init(mems_adaptive_rate *policy, float rate_max)
+{
+  memset(policy, 0, sizeof(mems_adaptive_rate));
+
+  policy->rate_max = rate_max;
+  policy->rate_steady = MEMS_ADAPTIVE_DEFAULT_RATE_STEADY;
+  policy->rate_stopped = MEMS_ADAPTIVE_DEFAULT_RATE_STOPPED;
+  policy->rpm_threshold = MEMS_ADAPTIVE_DEFAULT_RPM_THRESHOLD;
+  policy->throttle_threshold = MEMS_ADAPTIVE_DEFAULT_THROTTLE_THRESHOLD;
+  policy->steady_samples = MEMS_ADAPTIVE_DEFAULT_STEADY_SAMPLES;
+  policy->rate = rate_max;
+}
+
+/**
+ * Advances the policy with the values it watches from one sample.
+ */
+static float mems_adaptive_step(mems_adaptive_rate *policy, int engine_rpm, int throttle_angle,
+                                int fault_codes, const int *dtc)
+{
+  bool changed;
+
+  changed = !policy->primed ||
+            (abs(engine_rpm - policy->engine_rpm) > policy->rpm_threshold) ||
+            (abs(throttle_angle - policy->throttle_angle) > policy->throttle_threshold) ||
+            (fault_codes != policy->fault_codes) ||
+            (memcmp(dtc, policy->dtc, sizeof(policy->dtc)) != 0);
+
+  if (changed)
+  {
+    policy->primed = true;
+    policy->engine_rpm = engine_rpm;
+    policy->throttle_angle = throttle_angle;
+    policy->fault_codes = fault_codes;
+    memcpy(policy->dtc, dtc, sizeof(policy->dtc));
+    policy->steady_count = 0;
+    policy->rate = policy->rate_max;
+  }
+  else if (policy->steady_count < policy->steady_samples)
+  {
+    policy->steady_count += 1;
+  }
+  else
+  {
+    policy->rate = (engine_rpm == 0) ? policy->rate_stopped : policy->rate_steady;
+  }
+
+  return policy->rate;
+}
+
+/**
+ * Updates the policy with a new sample and returns the rate at which the
+ * next reads should be made. The full rate is used as soon as engine speed
+ * or throttle angle move by more than their thresholds from the values seen
+ * at the last change, or any fault code changes. Once steady_samples
+ * consecutive samples show no such change, the rate drops to rate_stopped
+ * if the engine is not turning, or to rate_steady otherwise.
+ * @param policy Policy state
+ * @param data Most recent sample
+ * @return Reads per second for the scheduler (0 for as fast as possible)
+ */
+float mems_adaptive_update(mems_adaptive_rate *policy, const mems_data *data)
+{
+  int dtc[4] = {data->dtc2, data->dtc3, data->dtc4, data->dtc5};
+
+  return mems_adaptive_step(policy, data->engine_rpm, data->throttle_angle, data->fault_codes, dtc);
+}
+
+/**
+ * Updates the policy as mems_adaptive_update() does, decoding only the
+ * fields it watches from a compact sample.
+ * @param policy Policy state
+ * @param sample Most recent sample
+ * @return Reads per second for the scheduler (0 for as fast as possible)
+ */
+float mems_adaptive_update_compact(mems_adaptive_rate *policy, const mems_compact_sample *sample)
+{
+  int dtc[4] = {mems_compact_dtc2(sample), mems_compact_dtc3(sample),
+                mems_compact_dtc4(sample), mems_compact_dtc5(sample)};
+
+  return mems_adaptive_step(policy, mems_compact_engine_rpm(sample), mems_compact_throttle_angle(sample),
+                            mems_compact_fault_codes(sample), dtc);
+}
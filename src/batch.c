@@ -0,0 +1,177 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// batch.c: This file contains the batch decoder, which converts
+//          many raw data frames at once into one array per field
+//          (struct-of-arrays), working one field at a time from
+//          the layout in MEMS_DATA_VALUES.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/*
+ * Each field is decoded in its own loop over the samples. Single-byte
+ * fields go through a 256-entry table built for the batch with
+ * mems_decode_field(), so the loop body is one load and one store with no
+ * branches or floating-point work, and the values are exactly those that
+ * the accessors and the scalar decoder give. Only the 16-bit and fault code
+ * fields are computed per sample. The table is built from a two-byte
+ * buffer, as mems_decode_field() may read the byte after the offset.
+ */
+
+#define MEMS_BATCH_DECODER(type)                                                                   \
+  static void mems_batch_##type(type *restrict column, const uint8_t *restrict bytes, size_t stride, \
+                                uint32_t count, uint8_t offset, mems_field_kind kind,               \
+                                double scale, double bias)                                          \
+  {                                                                                                 \
+    type table[256];                                                                                \
+    uint8_t byte[2] = {0, 0};                                                                       \
+    uint32_t idx;                                                                                   \
+                                                                                                    \
+    if ((kind == MEMS_Kind_Word) || (kind == MEMS_Kind_Faults))                                     \
+    {                                                                                               \
+      for (idx = 0; idx < count; idx++)                                                             \
+      {                                                                                             \
+        column[idx] = (type)mems_decode_field(bytes + (idx * stride), offset, kind, scale, bias);   \
+      }                                                                                             \
+    }                                                                                               \
+    else                                                                                            \
+    {                                                                                               \
+      for (idx = 0; idx < 256; idx++)                                                               \
+      {                                                                                             \
+        byte[0] = (uint8_t)idx;                                                                     \
+        table[idx] = (type)mems_decode_field(byte, 0, kind, scale, bias);                           \
+      }                                                                                             \
+                                                                                                    \
+      for (idx = 0; idx < count; idx++)                                                             \
+      {                                                                                             \
+        column[idx] = table[bytes[(idx * stride) + offset]];                                        \
+      }                                                                                             \
+    }                                                                                               \
+  }
+
+MEMS_BATCH_DECODER(int)
+MEMS_BATCH_DECODER(float)
+MEMS_BATCH_DECODER(bool)
+
+#undef MEMS_BATCH_DECODER
+
+/**
+ * Allocates the arrays for a set of fields.
+ * @param columns Column state
+ * @param capacity Most samples the arrays can hold
+ * @param fields Mask of MEMS_FIELD() bits (e.g. MEMS_ALL_FIELDS); raw7d and
+ *   raw80 are ignored
+ * @return True if every array was allocated
+ */
+bool mems_columns_init(mems_columns *columns, uint32_t capacity, uint64_t fields)
+{
+  bool result = true;
+
+  memset(columns, 0, sizeof(mems_columns));
+  columns->fields = fields & ~(MEMS_FIELD(raw7d) | MEMS_FIELD(raw80));
+  columns->capacity = capacity;
+
+#define MEMS_COLUMN_ALLOC(member, type, frame, offset, kind, scale, bias, name) \
+  if ((columns->fields & MEMS_FIELD(member)) && result)                         \
+  {                                                                             \
+    columns->member = (type *)malloc(capacity * sizeof(type));                  \
+    result = (columns->member != NULL);                                         \
+  }
+
+  MEMS_DATA_VALUES(MEMS_COLUMN_ALLOC)
+
+#undef MEMS_COLUMN_ALLOC
+
+  if (!result)
+  {
+    mems_columns_cleanup(columns);
+  }
+
+  return result;
+}
+
+/**
+ * Decodes frames laid out at a fixed stride (e.g. inside an array of
+ * structs) into columns, after any samples the columns already hold.
+ * @param frames80 First 0x80 frame, or NULL if no column needs it
+ * @param stride80 Bytes from one 0x80 frame to the next
+ * @param frames7d First 0x7D frame, or NULL if no column needs it
+ * @param stride7d Bytes from one 0x7D frame to the next
+ * @return Number of samples decoded
+ */
+uint32_t mems_decode_columns(const uint8_t *frames80, size_t stride80, const uint8_t *frames7d, size_t stride7d,
+                             uint32_t count, mems_columns *columns)
+{
+  uint8_t frames = mems_fields_frames(columns->fields);
+
+  if (((frames & MEMS_Frame80_Ready) && (frames80 == NULL)) ||
+      ((frames & MEMS_Frame7D_Ready) && (frames7d == NULL)))
+  {
+    dprintf_err("mems_decode_columns(): the columns need a frame that was not supplied\n");
+    return 0;
+  }
+
+  if (count > (columns->capacity - columns->count))
+  {
+    count = columns->capacity - columns->count;
+  }
+
+#define MEMS_COLUMN_DECODE(member, type, frame, offset, kind, scale, bias, name) \
+  if (columns->member)                                                           \
+  {                                                                              \
+    mems_batch_##type(columns->member + columns->count,                          \
+                      (frame == MEMS_Frame80_Ready) ? frames80 : frames7d,       \
+                      (frame == MEMS_Frame80_Ready) ? stride80 : stride7d,       \
+                      count, offset, kind, scale, bias);                         \
+  }
+
+  MEMS_DATA_VALUES(MEMS_COLUMN_DECODE)
+
+#undef MEMS_COLUMN_DECODE
+
+  columns->count += count;
+
+  return count;
+}
+
+/**
+ * Decodes arrays of raw data frames (e.g. a day of captured frames) into
+ * columns, after any samples the columns already hold. The values are the
+ * same as those mems_decode() produces for each pair of frames.
+ * @param frames80 Frames received in reply to command 0x80, or NULL if no
+ *   column needs them
+ * @param frames7d Frames received in reply to command 0x7D, or NULL if no
+ *   column needs them
+ * @param count Number of samples (elements of each array)
+ * @param columns Columns prepared with mems_columns_init()
+ * @return Number of samples decoded, which is less than count if the
+ *   columns filled up, or 0 if a needed frame array was not supplied
+ */
+uint32_t mems_decode_batch(const mems_data_frame_80 *frames80, const mems_data_frame_7d *frames7d, uint32_t count, mems_columns *columns)
+{
+  return mems_decode_columns((const uint8_t *)frames80, sizeof(mems_data_frame_80),
+                             (const uint8_t *)frames7d, sizeof(mems_data_frame_7d),
+                             count, columns);
+}
+
+/**
+ * Releases the arrays of a set of columns.
+ * @param columns Column state
+ */
+void mems_columns_cleanup(mems_columns *columns)
+{
+#define MEMS_COLUMN_FREE(member, type, frame, offset, kind, scale, bias, name) \
+  free(columns->member);                                                       \
+  columns->member = NULL;
+
+  MEMS_DATA_VALUES(MEMS_COLUMN_FREE)
+
+#undef MEMS_COLUMN_FREE
+
+  columns->fields = 0;
+  columns->capacity = 0;
+  columns->count = 0;
+}
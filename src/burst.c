@@ -0,0 +1,196 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// burst.c: This file contains the burst capture mode, which reads
+//          data frames back-to-back for a fixed time into a
+//          preallocated buffer and decodes them afterwards.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Input must be quiet for this long before a failed reply is taken to be over
+#define MEMS_BURST_QUIET_US (2 * MEMS_BYTE_TIME_US)
+
+/**
+ * Allocates the buffer for a burst capture.
+ * @param burst Burst state
+ * @param capacity Most samples that can be captured
+ * @return True if the buffer was allocated
+ */
+bool mems_burst_init(mems_burst *burst, uint32_t capacity)
+{
+  memset(burst, 0, sizeof(mems_burst));
+
+  burst->samples = (mems_burst_sample *)malloc(capacity * sizeof(mems_burst_sample));
+  if (burst->samples == NULL)
+  {
+    return false;
+  }
+
+  burst->capacity = capacity;
+
+  return true;
+}
+
+/**
+ * Requests one data frame and reads it, failing at once (with nothing
+ * reported) if the echo or frame is wrong or short. The rest of a failed
+ * reply is discarded, up to the deadline, so that it is not read as the
+ * reply to the next request; the full resynchronisation waits until the
+ * end of the capture.
+ * @return True if the whole frame arrived by the deadline
+ */
+static bool mems_burst_read_frame(mems_info *info, uint8_t cmd, uint8_t *frame, uint16_t size, uint64_t deadline_us)
+{
+  uint8_t stale[64];
+  int16_t count;
+
+  if (mems_send_command_quiet(info, cmd, deadline_us) &&
+      (mems_read_serial_quiet(info, frame, size, deadline_us) == size))
+  {
+    return true;
+  }
+
+  info->transport->flush(info);
+
+  while ((mems_monotonic_us() < deadline_us) &&
+         info->transport->wait_readable(info, MEMS_BURST_QUIET_US) &&
+         ((count = info->transport->read(info, stale, sizeof(stale))) > 0))
+  {
+    info->link_stats.discarded += count;
+  }
+
+  return false;
+}
+
+/**
+ * Reads the data frames needed for a set of fields back-to-back, as fast as
+ * the link allows, until the duration has passed or the buffer is full.
+ * The connection is locked for the whole capture and nothing is decoded
+ * until afterwards (see mems_burst_decode()). A sample whose frames do not
+ * all arrive within the read timeout is counted as an error and skipped,
+ * without retries; if there were any, the link is resynchronised once the
+ * capture has ended.
+ * @param info State information for the current connection.
+ * @param burst Burst state prepared with mems_burst_init()
+ * @param fields Mask of MEMS_FIELD() bits to capture
+ * @param duration_ms Length of the capture
+ * @return True if at least one sample was captured
+ */
+bool mems_burst_capture(mems_info *info, mems_burst *burst, uint64_t fields, uint32_t duration_ms)
+{
+  mems_burst_sample *sample;
+  uint64_t end_us;
+  uint64_t deadline_us;
+  bool ok;
+
+  burst->frames = mems_fields_frames(fields);
+  burst->count = 0;
+  burst->errors = 0;
+
+  if ((burst->frames == 0) || !mems_lock(info))
+  {
+    return false;
+  }
+
+  burst->started_us = mems_monotonic_us();
+  end_us = burst->started_us + ((uint64_t)duration_ms * 1000);
+
+  while ((burst->count < burst->capacity) && (mems_monotonic_us() < end_us))
+  {
+    sample = &burst->samples[burst->count];
+    sample->timestamp_us = mems_monotonic_us();
+    deadline_us = sample->timestamp_us + ((uint64_t)info->read_timeout_ms * 1000) +
+                  ((sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d) + 2) * MEMS_BYTE_TIME_US);
+    ok = true;
+
+    if (burst->frames & MEMS_Frame80_Ready)
+    {
+      ok = mems_burst_read_frame(info, MEMS_ReqData80, (uint8_t *)&sample->frame80, sizeof(mems_data_frame_80), deadline_us);
+    }
+
+    if (ok && (burst->frames & MEMS_Frame7D_Ready))
+    {
+      ok = mems_burst_read_frame(info, MEMS_ReqData7D, (uint8_t *)&sample->frame7d, sizeof(mems_data_frame_7d), deadline_us);
+    }
+
+    if (ok)
+    {
+      burst->count += 1;
+    }
+    else
+    {
+      burst->errors += 1;
+    }
+  }
+
+  burst->elapsed_us = mems_monotonic_us() - burst->started_us;
+
+  if (burst->errors > 0)
+  {
+    info->link_stats.failures += burst->errors;
+    mems_resync_locked(info, MEMS_NO_DEADLINE);
+  }
+
+  mems_unlock(info);
+
+  return (burst->count > 0);
+}
+
+/**
+ * Decodes one captured sample. Fields from frames that were not captured
+ * are zeroed and left out of data->frames.
+ * @param burst Burst state
+ * @param index Sample number, less than burst->count
+ * @param data Receives the decoded values
+ */
+void mems_burst_decode(const mems_burst *burst, uint32_t index, mems_data *data)
+{
+  memset(data, 0, sizeof(mems_data));
+
+  if (burst->frames & MEMS_Frame80_Ready)
+  {
+    mems_decode_80(&burst->samples[index].frame80, data);
+  }
+
+  if (burst->frames & MEMS_Frame7D_Ready)
+  {
+    mems_decode_7d(&burst->samples[index].frame7d, data);
+  }
+}
+
+/**
+ * Decodes every captured sample into columns, after any samples the columns
+ * already hold. The columns must only have fields from the frames that
+ * were captured.
+ * @param burst Burst state
+ * @param columns Columns prepared with mems_columns_init()
+ * @return Number of samples decoded, which is less than burst->count if
+ *   the columns filled up
+ */
+uint32_t mems_burst_decode_columns(const mems_burst *burst, mems_columns *columns)
+{
+  if (mems_fields_frames(columns->fields) & ~burst->frames)
+  {
+    dprintf_err("mems_burst_decode_columns(): columns need a frame that was not captured\n");
+    return 0;
+  }
+
+  return mems_decode_columns((const uint8_t *)&burst->samples[0].frame80, sizeof(mems_burst_sample),
+                             (const uint8_t *)&burst->samples[0].frame7d, sizeof(mems_burst_sample),
+                             burst->count, columns);
+}
+
+/**
+ * Releases the buffer of a burst capture.
+ * @param burst Burst state
+ */
+void mems_burst_cleanup(mems_burst *burst)
+{
+  free(burst->samples);
+  burst->samples = NULL;
+  burst->capacity = 0;
+  burst->count = 0;
+}
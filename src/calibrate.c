@@ -0,0 +1,197 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// calibrate.c: This file contains a routine that measures the
+//              latency of a link (echo latency, gaps between reply
+//              bytes and data frame round trips) and derives a read
+//              timeout and polling rate that the link can sustain.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Time allowed for each probe; generous, since the timeout is what is being measured
+#define MEMS_CALIBRATE_PROBE_MS 1000
+
+//! Shortest read timeout that will be recommended
+#define MEMS_CALIBRATE_MIN_TIMEOUT_MS 10
+
+//! Headroom allowed over the slowest data read when recommending a rate, for
+//! the turnaround between commands and reads slower than any measured
+#define MEMS_CALIBRATE_RATE_MARGIN 1.2
+
+/**
+ * Orders latencies for qsort().
+ */
+static int mems_compare_us(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Sorts a set of measurements and summarises them with nearest-rank
+ * percentiles.
+ */
+static void mems_latency_summarise(uint32_t *values, uint32_t count, mems_latency_stats *stats)
+{
+  memset(stats, 0, sizeof(mems_latency_stats));
+
+  if (count == 0)
+  {
+    return;
+  }
+
+  qsort(values, count, sizeof(uint32_t), mems_compare_us);
+
+  stats->count = count;
+  stats->p50_us = values[((count * 50) + 99) / 100 - 1];
+  stats->p90_us = values[((count * 90) + 99) / 100 - 1];
+  stats->p99_us = values[((count * 99) + 99) / 100 - 1];
+  stats->max_us = values[count - 1];
+}
+
+/**
+ * Sends one command and reads its reply a byte at a time, timing the echo
+ * and the gap before each following byte.
+ * @param gaps Receives reply_len gaps, appended at *gap_count
+ * @param rtt_us Receives the time from sending the command to the last byte
+ * @return True if the whole reply arrived with the expected echo
+ */
+static bool mems_probe_command(mems_info *info, uint8_t cmd, uint16_t reply_len,
+                               uint32_t *echo_us, uint32_t *gaps, uint32_t *gap_count, uint32_t *rtt_us)
+{
+  uint64_t deadline_us = mems_deadline_ms(MEMS_CALIBRATE_PROBE_MS);
+  uint64_t sent_us;
+  uint64_t last_us;
+  uint64_t now;
+  uint8_t byte;
+  uint16_t idx;
+
+  sent_us = mems_monotonic_us();
+  if ((mems_write_serial(info, &cmd, 1) != 1) ||
+      (mems_read_serial_timed(info, &byte, 1, deadline_us) != 1) || (byte != cmd))
+  {
+    return false;
+  }
+
+  last_us = mems_monotonic_us();
+  *echo_us = (uint32_t)(last_us - sent_us);
+
+  for (idx = 0; idx < reply_len; idx++)
+  {
+    if (mems_read_serial_timed(info, &byte, 1, deadline_us) != 1)
+    {
+      return false;
+    }
+
+    now = mems_monotonic_us();
+    gaps[(*gap_count)++] = (uint32_t)(now - last_us);
+    last_us = now;
+  }
+
+  *rtt_us = (uint32_t)(last_us - sent_us);
+
+  return true;
+}
+
+/**
+ * Measures the latency of a link with a series of heartbeats and complete
+ * (0x80 + 0x7D) data reads, and recommends a read timeout and the highest
+ * polling rate the link can sustain. The timeout covers the worst echo
+ * latency or gap between bytes seen, with a 2x margin; the rate leaves
+ * 20% headroom over the slowest data read, so that polling at it does not
+ * miss periods whenever a read is slower than usual. After a failed probe
+ * the link is resynchronised, so that the rest of a bad reply is not taken
+ * for the reply to the next probe.
+ * @param info State information for the current connection.
+ * @param iterations Number of heartbeats and of data reads to make
+ * @param apply True to set info->read_timeout_ms to the recommended value.
+ *   The timeout only bounds reads in non-blocking mode (blocking reads wait
+ *   on the device's own VTIME), so applying it also switches the link to
+ *   non-blocking reads; where those are not supported, nothing is applied.
+ * @param result Receives the measurements and recommendations
+ * @return True if every probe succeeded
+ */
+bool mems_calibrate(mems_info *info, uint32_t iterations, bool apply, mems_calibration *result)
+{
+  uint32_t *echoes;
+  uint32_t *gaps;
+  uint32_t *rtts;
+  uint32_t echo_count = 0;
+  uint32_t gap_count = 0;
+  uint32_t rtt_count = 0;
+  uint32_t rtt80;
+  uint32_t rtt7d;
+  uint32_t worst_us;
+  uint32_t idx;
+
+  memset(result, 0, sizeof(mems_calibration));
+
+  // every iteration makes three probes, each with an echo and its reply bytes
+  echoes = (uint32_t *)malloc(iterations * 3 * sizeof(uint32_t));
+  gaps = (uint32_t *)malloc(iterations * (1 + sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)) * sizeof(uint32_t));
+  rtts = (uint32_t *)malloc(iterations * sizeof(uint32_t));
+
+  if (echoes && gaps && rtts && mems_lock(info))
+  {
+    for (idx = 0; idx < iterations; idx++)
+    {
+      if (!mems_probe_command(info, MEMS_Heartbeat, 1, &echoes[echo_count], gaps, &gap_count, &rtt80))
+      {
+        result->errors += 1;
+        mems_resync_locked(info, mems_deadline_ms(MEMS_CALIBRATE_PROBE_MS));
+        continue;
+      }
+      echo_count += 1;
+
+      if (mems_probe_command(info, MEMS_ReqData80, sizeof(mems_data_frame_80), &echoes[echo_count], gaps, &gap_count, &rtt80) &&
+          mems_probe_command(info, MEMS_ReqData7D, sizeof(mems_data_frame_7d), &echoes[echo_count + 1], gaps, &gap_count, &rtt7d))
+      {
+        echo_count += 2;
+        rtts[rtt_count++] = rtt80 + rtt7d;
+      }
+      else
+      {
+        result->errors += 1;
+        mems_resync_locked(info, mems_deadline_ms(MEMS_CALIBRATE_PROBE_MS));
+      }
+    }
+
+    mems_unlock(info);
+  }
+  else
+  {
+    result->errors = iterations;
+  }
+
+  mems_latency_summarise(echoes, echo_count, &result->echo);
+  mems_latency_summarise(gaps, gap_count, &result->byte_gap);
+  mems_latency_summarise(rtts, rtt_count, &result->frame_rtt);
+
+  free(echoes);
+  free(gaps);
+  free(rtts);
+
+  worst_us = (result->echo.max_us > result->byte_gap.max_us) ? result->echo.max_us : result->byte_gap.max_us;
+  result->read_timeout_ms = (uint16_t)(((worst_us * 2) + 999) / 1000);
+  if (result->read_timeout_ms < MEMS_CALIBRATE_MIN_TIMEOUT_MS)
+  {
+    result->read_timeout_ms = MEMS_CALIBRATE_MIN_TIMEOUT_MS;
+  }
+
+  if (result->frame_rtt.max_us > 0)
+  {
+    result->max_rate_hz = 1000000.0 / (result->frame_rtt.max_us * MEMS_CALIBRATE_RATE_MARGIN);
+  }
+
+  if (apply && (rtt_count > 0) && mems_set_nonblocking(info, true))
+  {
+    info->read_timeout_ms = result->read_timeout_ms;
+  }
+
+  return (result->errors == 0) && (rtt_count > 0);
+}
@@ -0,0 +1,186 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// ecusim.c: This file contains a model of a MEMS 1.6 ECU that
+//           answers commands with plausible replies. It is used by
+//           the in-memory loopback transport and by mems-sim.
+
+#include <string.h>
+
+#include "rosco.h"
+
+#define MEMS_ECUSIM_D0_0 0x99
+#define MEMS_ECUSIM_D0_1 0x00
+#define MEMS_ECUSIM_D0_2 0x03
+#define MEMS_ECUSIM_D0_3 0x03
+
+/**
+ * Sets the initial state of the simulated engine: warm, idling, IAC part open.
+ * @param ecu Simulated ECU state
+ * @param engine_running False to simulate the ignition on with the engine stopped
+ */
+void mems_ecusim_init(mems_ecusim *ecu, bool engine_running)
+{
+  memset(ecu, 0, sizeof(mems_ecusim));
+  ecu->engine_running = engine_running;
+  ecu->engine_rpm = engine_running ? 850 : 0;
+  ecu->coolant_temp = 30 + 55;
+  ecu->iac_position = 0x30;
+  ecu->lambda_voltage = 0x14;
+}
+
+/**
+ * Advances the simulation by one data request so that successive frames
+ * contain plausible, slowly changing values.
+ */
+static void mems_ecusim_step(mems_ecusim *ecu)
+{
+  ecu->tick += 1;
+
+  if (ecu->engine_running)
+  {
+    // idle hunting of +/- 25 rpm
+    ecu->engine_rpm = 850 + ((ecu->tick % 11) * 5) - 25;
+
+    // warm up to 90C
+    if ((ecu->coolant_temp < (90 + 55)) && ((ecu->tick % 8) == 0))
+      ecu->coolant_temp += 1;
+
+    // lambda switching between lean (100mV) and rich (700mV)
+    ecu->lambda_voltage = ((ecu->tick / 3) % 2) ? 0x8C : 0x14;
+  }
+}
+
+static void mems_ecusim_frame80(mems_ecusim *ecu, mems_data_frame_80 *f)
+{
+  uint16_t coil_time = ecu->engine_running ? 1500 : 0;
+
+  memset(f, 0, sizeof(mems_data_frame_80));
+  f->bytes_in_frame = sizeof(mems_data_frame_80);
+  f->engine_rpm_hi = ecu->engine_rpm >> 8;
+  f->engine_rpm_lo = ecu->engine_rpm & 0xFF;
+  f->coolant_temp = ecu->coolant_temp;
+  f->ambient_temp = 0xFF;
+  f->intake_air_temp = 20 + 55;
+  f->fuel_temp = 0xFF;
+  f->map_kpa = ecu->engine_running ? 0x23 : 0x64;
+  f->battery_voltage = ecu->engine_running ? 140 : 124;
+  f->throttle_pot = 0x24;
+  f->idle_switch = 0x10;
+  f->uk1 = 0x00;
+  f->park_neutral_switch = 0x00;
+  f->idle_set_point = 0x5A;
+  f->idle_hot = 0x88;
+  f->uk2 = 0x00;
+  f->iac_position = ecu->iac_position;
+  f->idle_error_hi = 0x00;
+  f->idle_error_lo = 0x09;
+  f->ignition_advance_offset = 0x00;
+  f->ignition_advance = ecu->engine_running ? 72 : 48;
+  f->coil_time_hi = coil_time >> 8;
+  f->coil_time_lo = coil_time & 0xFF;
+  f->crankshaft_position_sensor = ecu->engine_running ? 0x20 : 0x00;
+  f->uk4 = 0x00;
+  f->uk5 = 0x00;
+}
+
+static void mems_ecusim_frame7d(mems_ecusim *ecu, mems_data_frame_7d *f)
+{
+  memset(f, 0, sizeof(mems_data_frame_7d));
+  f->bytes_in_frame = sizeof(mems_data_frame_7d);
+  f->ignition_switch = 0x01;
+  f->throttle_angle = 0x0A;
+  f->air_fuel_ratio = 0x92;
+  f->lambda_voltage = ecu->lambda_voltage;
+  f->lambda_sensor_frequency = ecu->engine_running ? 0x3E : 0xFF;
+  f->lambda_sensor_dutycycle = ecu->engine_running ? 0x7E : 0xFF;
+  f->lambda_sensor_status = ecu->engine_running ? 0x01 : 0x00;
+  f->closed_loop = ecu->engine_running ? 0x01 : 0x00;
+  f->long_term_fuel_trim = 0x80;
+  f->short_term_fuel_trim = 0x64;
+  f->carbon_canister_dutycycle = 0x00;
+  f->idle_base_pos = 0x30;
+  f->ignition_advance2 = 0x2A;
+  f->idle_speed_offset = 0x80;
+  f->uk15 = 0x40;
+  f->uk19 = 0x1E;
+}
+
+/**
+ * Builds the reply the ECU would send to a single command byte, including
+ * the echo of the command itself.
+ * @param ecu Simulated ECU state
+ * @param cmd Command byte received
+ * @param reply Receives the reply; must hold MEMS_ECUSIM_MAX_REPLY bytes
+ * @return Number of bytes in the reply (0 if the command was ignored)
+ */
+size_t mems_ecusim_respond(mems_ecusim *ecu, uint8_t cmd, uint8_t *reply)
+{
+  size_t len = 0;
+
+  ecu->commands += 1;
+
+  // a cold ECU ignores everything until the start of the initialisation
+  // sequence; the session then lasts until the ignition is switched off
+  // (i.e. the simulation is restarted)
+  if (!ecu->session && (cmd != 0xCA))
+  {
+    return 0;
+  }
+
+  reply[len++] = cmd;
+
+  switch (cmd)
+  {
+  case 0xCA:
+    ecu->session = true;
+    break;
+
+  case 0x75:
+    // initialisation sequence: echo only
+    break;
+
+  case 0xD0:
+    reply[len++] = MEMS_ECUSIM_D0_0;
+    reply[len++] = MEMS_ECUSIM_D0_1;
+    reply[len++] = MEMS_ECUSIM_D0_2;
+    reply[len++] = MEMS_ECUSIM_D0_3;
+    break;
+
+  case MEMS_ReqData80:
+    mems_ecusim_step(ecu);
+    mems_ecusim_frame80(ecu, (mems_data_frame_80 *)(reply + len));
+    len += sizeof(mems_data_frame_80);
+    ecu->frames80 += 1;
+    break;
+
+  case MEMS_ReqData7D:
+    mems_ecusim_frame7d(ecu, (mems_data_frame_7d *)(reply + len));
+    len += sizeof(mems_data_frame_7d);
+    ecu->frames7d += 1;
+    break;
+
+  case MEMS_GetIACPosition:
+    reply[len++] = ecu->iac_position;
+    break;
+
+  case MEMS_OpenIAC:
+    if (ecu->iac_position < IAC_MAXIMUM)
+      ecu->iac_position += 1;
+    reply[len++] = ecu->iac_position;
+    break;
+
+  case MEMS_CloseIAC:
+    if (ecu->iac_position > 0)
+      ecu->iac_position -= 1;
+    reply[len++] = ecu->iac_position;
+    break;
+
+  default:
+    // heartbeat, clear faults, resets and the remaining actuator tests
+    // all reply with the echo followed by a single 0x00
+    reply[len++] = 0x00;
+    break;
+  }
+
+  return len;
+}
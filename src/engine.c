@@ -0,0 +1,361 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// engine.c: This file contains an acquisition engine that polls
+//           several ECU connections from a single epoll event
+//           loop, so that one thread can serve many links.
+
+#if defined(linux)
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Starts or stops watching a link's descriptor. A link is only watched
+ * while the engine holds its lock, so that bytes another thread is waiting
+ * for (e.g. in mems_read()) are left for that thread to read.
+ */
+static bool mems_engine_watch(mems_engine *engine, mems_engine_link *link, bool watch)
+{
+  struct epoll_event ev;
+
+  ev.events = watch ? EPOLLIN : 0;
+  ev.data.u32 = (uint32_t)(link - engine->links);
+
+  return (epoll_ctl(engine->epfd, EPOLL_CTL_MOD, link->info->sd, &ev) == 0);
+}
+
+/**
+ * Writes a data request on a link that the engine has already locked, and
+ * arms the reply deadline.
+ */
+static bool mems_engine_request(mems_engine *engine, mems_engine_link *link, uint8_t cmd)
+{
+  link->command = cmd;
+  link->deadline_us = mems_monotonic_us() + ((uint64_t)engine->timeout_ms * 1000);
+
+  return (mems_write_serial(link->info, &cmd, 1) == 1);
+}
+
+/**
+ * Starts a new 0x80/0x7D cycle on a link, provided that no other thread is
+ * currently using the connection.
+ */
+static void mems_engine_start(mems_engine *engine, mems_engine_link *link)
+{
+  if (!link->busy && !link->dead && (pthread_mutex_trylock(&link->info->mutex) == 0))
+  {
+    link->busy = true;
+    mems_parser_init(&link->parser);
+    link->started_us = mems_monotonic_us();
+
+    // drop anything left over from before the cycle (e.g. a late reply)
+    link->info->transport->flush(link->info);
+
+    if (!mems_engine_watch(engine, link, true))
+    {
+      dprintf_err("mems_engine: failed to watch link %d\n", (int)(link - engine->links));
+    }
+
+    if (!mems_engine_request(engine, link, MEMS_ReqData80))
+    {
+      // leave the link busy; the deadline will report the failure
+      dprintf_err("mems_engine: failed to send command 80 on link %d\n", (int)(link - engine->links));
+    }
+  }
+}
+
+/**
+ * Ends the current cycle on a link, releases the connection and reports the
+ * outcome to the callback.
+ */
+static void mems_engine_finish(mems_engine *engine, mems_engine_link *link, bool success)
+{
+  mems_compact_sample sample;
+  mems_data data;
+  int id = (int)(link - engine->links);
+
+  // don't let the rest of a failed reply be taken for the next one
+  if (!success)
+  {
+    link->info->transport->flush(link->info);
+  }
+
+  mems_engine_watch(engine, link, false);
+  link->busy = false;
+  pthread_mutex_unlock(&link->info->mutex);
+
+  if (success)
+  {
+    link->samples += 1;
+    sample.timestamp_us = link->started_us;
+    memcpy(&sample.frame80, &link->frame80, sizeof(mems_data_frame_80));
+    memcpy(&sample.frame7d, &link->frame7d, sizeof(mems_data_frame_7d));
+    sample.frames = MEMS_Frame80_Ready | MEMS_Frame7D_Ready;
+    mems_publish_latest(link->info, &sample);
+
+    mems_decode(&link->frame80, &link->frame7d, &data);
+    engine->callback(engine->context, id, true, &data);
+  }
+  else
+  {
+    link->errors += 1;
+    engine->callback(engine->context, id, false, NULL);
+  }
+}
+
+/**
+ * Reads whatever has arrived on a link and advances its cycle: the 0x7D
+ * request is sent once the 0x80 frame is complete, and the sample is
+ * delivered once the 0x7D frame is complete.
+ */
+static void mems_engine_receive(mems_engine *engine, mems_engine_link *link)
+{
+  uint8_t buffer[64];
+  uint8_t command;
+  ssize_t count;
+  size_t used;
+
+  // the connection belongs to another thread between cycles
+  if (!link->busy)
+  {
+    return;
+  }
+
+  while (link->busy && ((count = link->info->transport->read(link->info, buffer, sizeof(buffer))) > 0))
+  {
+    used = 0;
+    while (link->busy && (used < (size_t)count))
+    {
+      used += mems_parser_feed(&link->parser, buffer + used, count - used, &command);
+
+      if (command == 0)
+        continue;
+
+      if (command != link->command)
+      {
+        dprintf_err("mems_engine: unexpected frame %02X on link %d\n", command, (int)(link - engine->links));
+        mems_engine_finish(engine, link, false);
+      }
+      else if (command == MEMS_ReqData80)
+      {
+        memcpy(&link->frame80, &link->parser.frame.f80, sizeof(mems_data_frame_80));
+        if (!mems_engine_request(engine, link, MEMS_ReqData7D))
+          mems_engine_finish(engine, link, false);
+      }
+      else
+      {
+        memcpy(&link->frame7d, &link->parser.frame.f7d, sizeof(mems_data_frame_7d));
+        mems_engine_finish(engine, link, true);
+      }
+    }
+  }
+}
+
+/**
+ * Stops polling a link whose descriptor has hung up or failed (e.g. a USB
+ * adapter that was unplugged), which epoll would otherwise report on every
+ * wait, and reports the failure to the callback.
+ */
+static void mems_engine_drop(mems_engine *engine, mems_engine_link *link)
+{
+  int id = (int)(link - engine->links);
+
+  dprintf_err("mems_engine: link %d hung up\n", id);
+
+  if (link->busy)
+  {
+    mems_engine_finish(engine, link, false);
+  }
+  else
+  {
+    link->errors += 1;
+    engine->callback(engine->context, id, false, NULL);
+  }
+
+  epoll_ctl(engine->epfd, EPOLL_CTL_DEL, link->info->sd, NULL);
+  link->dead = true;
+}
+
+/**
+ * Prepares an engine with no links.
+ * @param engine Engine state
+ * @param callback Function called with each decoded sample (or failure)
+ * @param context Passed unchanged to the callback
+ * @return True if the epoll instance was created
+ */
+bool mems_engine_init(mems_engine *engine, mems_engine_callback callback, void *context)
+{
+  memset(engine, 0, sizeof(mems_engine));
+  engine->callback = callback;
+  engine->context = context;
+  engine->timeout_ms = MEMS_DEFAULT_READ_TIMEOUT_MS * 2;
+  engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+  return (engine->epfd >= 0);
+}
+
+/**
+ * Adds a connection to the engine. The connection must already be open and
+ * initialised with mems_init_link(), and its transport must have a
+ * descriptor that epoll can watch; it is switched to non-blocking mode.
+ * @param engine Engine state
+ * @param info Connection to poll
+ * @return Identifier passed to the callback with samples from this
+ *   connection, or -1 if it could not be added
+ */
+int mems_engine_add(mems_engine *engine, mems_info *info)
+{
+  struct epoll_event ev;
+  int id = engine->count;
+
+  if ((id >= MEMS_ENGINE_MAX_LINKS) || !mems_is_connected(info) ||
+      !info->transport->has_fd || !mems_set_nonblocking(info, true))
+  {
+    return -1;
+  }
+
+  memset(&engine->links[id], 0, sizeof(mems_engine_link));
+  engine->links[id].info = info;
+
+  // not watched until the engine starts a cycle on it
+  ev.events = 0;
+  ev.data.u32 = id;
+  if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, info->sd, &ev) != 0)
+  {
+    return -1;
+  }
+
+  engine->count += 1;
+
+  return id;
+}
+
+/**
+ * Runs one iteration of the event loop: starts a cycle on every idle link,
+ * waits up to timeout_ms for replies (or the nearest reply deadline), and
+ * processes whatever arrived. A link whose descriptor hangs up or fails is
+ * reported to the callback as a failure and is no longer polled.
+ * @param engine Engine state
+ * @param timeout_ms Longest time to wait for activity
+ * @return Number of links with activity, or -1 on error
+ */
+int mems_engine_run_once(mems_engine *engine, int timeout_ms)
+{
+  struct epoll_event events[MEMS_ENGINE_MAX_LINKS];
+  mems_engine_link *link;
+  uint64_t now = mems_monotonic_us();
+  uint64_t wait_us = (uint64_t)timeout_ms * 1000;
+  int ready;
+  int idx;
+
+  for (idx = 0; idx < engine->count; idx++)
+  {
+    mems_engine_start(engine, &engine->links[idx]);
+
+    if (engine->links[idx].busy)
+    {
+      if (engine->links[idx].deadline_us <= now)
+        wait_us = 0;
+      else if ((engine->links[idx].deadline_us - now) < wait_us)
+        wait_us = engine->links[idx].deadline_us - now;
+    }
+  }
+
+  ready = epoll_wait(engine->epfd, events, MEMS_ENGINE_MAX_LINKS, (int)((wait_us + 999) / 1000));
+
+  if ((ready < 0) && (errno != EINTR))
+  {
+    return -1;
+  }
+
+  for (idx = 0; idx < ready; idx++)
+  {
+    link = &engine->links[events[idx].data.u32];
+
+    if (events[idx].events & EPOLLIN)
+    {
+      mems_engine_receive(engine, link);
+    }
+
+    // hang-ups and errors are reported even while a link is not watched
+    if (events[idx].events & (EPOLLHUP | EPOLLERR))
+    {
+      mems_engine_drop(engine, link);
+    }
+  }
+
+  // expire any cycles that are still waiting for a reply
+  now = mems_monotonic_us();
+  for (idx = 0; idx < engine->count; idx++)
+  {
+    if (engine->links[idx].busy && (engine->links[idx].deadline_us <= now))
+    {
+      dprintf_err("mems_engine: timed out waiting for frame %02X on link %d\n", engine->links[idx].command, idx);
+      mems_engine_finish(engine, &engine->links[idx], false);
+    }
+  }
+
+  return (ready > 0) ? ready : 0;
+}
+
+/**
+ * Runs the event loop until mems_engine_stop() is called (typically from
+ * the callback) or an error occurs.
+ * @param engine Engine state
+ * @return True if the loop was stopped; false on error
+ */
+bool mems_engine_run(mems_engine *engine)
+{
+  engine->stop = false;
+
+  while (!engine->stop)
+  {
+    if (mems_engine_run_once(engine, MEMS_DEFAULT_READ_TIMEOUT_MS) < 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Asks mems_engine_run() to return after the current iteration.
+ * @param engine Engine state
+ */
+void mems_engine_stop(mems_engine *engine)
+{
+  engine->stop = true;
+}
+
+/**
+ * Releases the epoll instance and any connection locks still held by the
+ * engine. The connections themselves are left open.
+ * @param engine Engine state
+ */
+void mems_engine_cleanup(mems_engine *engine)
+{
+  int idx;
+
+  for (idx = 0; idx < engine->count; idx++)
+  {
+    if (engine->links[idx].busy)
+    {
+      engine->links[idx].busy = false;
+      pthread_mutex_unlock(&engine->links[idx].info->mutex);
+    }
+  }
+
+  if (engine->epfd >= 0)
+  {
+    close(engine->epfd);
+    engine->epfd = -1;
+  }
+}
+
+#endif // linux
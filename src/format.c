@@ -0,0 +1,381 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// format.c: This file contains the field descriptors and the CSV
+//           formatter, both generated from the frame layout in
+//           MEMS_DATA_FIELDS, so that log headers and lines always
+//           match what the decoder produces. Values are formatted
+//           with lookup tables and integer arithmetic rather than
+//           printf(), as formatting runs for every sample logged.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_FIELD_DESCRIPTOR(member, type, frame, offset, kind, scale, bias, name) \
+  {#member, name, frame, offset, kind, scale, bias},
+
+//! Description of each field, indexed by mems_field
+static const mems_field_descriptor mems_field_descriptors[MEMS_Field_Count] = {
+    MEMS_DATA_FIELDS(MEMS_FIELD_DESCRIPTOR)};
+
+#undef MEMS_FIELD_DESCRIPTOR
+
+//! Digits for hex encoding, one per nibble
+static const char mems_hex_digits[] = "0123456789abcdef";
+
+//! Decimal digits of 0 to 99, two characters each
+static const char mems_decimal_pairs[] = "00010203040506070809"
+                                         "10111213141516171819"
+                                         "20212223242526272829"
+                                         "30313233343536373839"
+                                         "40414243444546474849"
+                                         "50515253545556575859"
+                                         "60616263646566676869"
+                                         "70717273747576777879"
+                                         "80818283848586878889"
+                                         "90919293949596979899";
+
+//! Room for any one formatted value, including the separator
+#define MEMS_FORMAT_SCRATCH 128
+
+/*
+ * Values are formatted by the type of their mems_data member; the raw
+ * frames are prefixed with the command that returned them, as MEMS-Scan
+ * does.
+ */
+#define MEMS_CSV_int(out, value, frame) mems_format_int(out, (value))
+#define MEMS_CSV_bool(out, value, frame) mems_format_int(out, (int)(value))
+#define MEMS_CSV_float(out, value, frame) mems_format_fixed(out, (value))
+#define MEMS_CSV_char(out, value, frame) mems_format_raw(out, frame, (value))
+
+/**
+ * Appends formatted text to a buffer in the manner of snprintf(): once the
+ * buffer is full, further text is counted but not written, and the buffer
+ * stays terminated.
+ * @return Length of the text so far, including any that did not fit
+ */
+static size_t mems_format_append(char *buffer, size_t size, size_t len, const char *format, ...)
+{
+  va_list args;
+  int count;
+
+  va_start(args, format);
+  count = vsnprintf((len < size) ? (buffer + len) : NULL, (len < size) ? (size - len) : 0, format, args);
+  va_end(args);
+
+  return (count > 0) ? (len + count) : len;
+}
+
+/**
+ * Returns the command byte, as text, of the frame a field is decoded from.
+ */
+static const char *mems_frame_label(uint8_t frame)
+{
+  return (frame == MEMS_Frame80_Ready) ? "80" : "7d";
+}
+
+/**
+ * Copies text to the end of a buffer with the same truncation rules as
+ * mems_format_append().
+ */
+static size_t mems_format_copy(char *buffer, size_t size, size_t len, const char *text, size_t count)
+{
+  size_t room;
+
+  if (len < size)
+  {
+    room = size - len - 1;
+    if (count < room)
+    {
+      room = count;
+    }
+
+    memcpy(buffer + len, text, room);
+    buffer[len + room] = 0;
+  }
+
+  return len + count;
+}
+
+/**
+ * Writes an unsigned integer in decimal, two digits at a time.
+ * @return Number of characters written (no terminator)
+ */
+static size_t mems_format_uint(char *out, uint64_t value)
+{
+  char digits[20];
+  char *first = digits + sizeof(digits);
+  size_t count;
+
+  while (value >= 100)
+  {
+    first -= 2;
+    memcpy(first, &mems_decimal_pairs[(value % 100) * 2], 2);
+    value /= 100;
+  }
+
+  if (value >= 10)
+  {
+    first -= 2;
+    memcpy(first, &mems_decimal_pairs[value * 2], 2);
+  }
+  else
+  {
+    *--first = (char)('0' + value);
+  }
+
+  count = (digits + sizeof(digits)) - first;
+  memcpy(out, first, count);
+
+  return count;
+}
+
+/**
+ * Writes a signed integer as printf("%d") does.
+ * @return Number of characters written (no terminator)
+ */
+static size_t mems_format_int(char *out, int value)
+{
+  if (value < 0)
+  {
+    out[0] = '-';
+    return 1 + mems_format_uint(out + 1, (uint64_t)(-(int64_t)value));
+  }
+
+  return mems_format_uint(out, (uint64_t)value);
+}
+
+/**
+ * Writes a float as printf("%f") does, with six decimal places rounded to
+ * even. A float has at most 24 significant bits, so scaling it by 10^6
+ * (15625 * 2^6) in double precision is exact, and the rounding can be done
+ * on the integer part and fraction of the scaled value.
+ * @return Number of characters written (no terminator)
+ */
+static size_t mems_format_fixed(char *out, float value)
+{
+  double scaled = (double)value * 1000000.0;
+  uint64_t micros;
+  double fraction;
+  size_t count = 0;
+
+  if (signbit(scaled))
+  {
+    out[count++] = '-';
+    scaled = -scaled;
+  }
+
+  // too large for the integer path (or not a number)
+  if (!(scaled < 9.0e18))
+  {
+    return (size_t)snprintf(out, MEMS_FORMAT_SCRATCH - 1, "%f", (double)value);
+  }
+
+  micros = (uint64_t)scaled;
+  fraction = scaled - (double)micros;
+  if ((fraction > 0.5) || ((fraction == 0.5) && (micros & 1)))
+  {
+    micros += 1;
+  }
+
+  count += mems_format_uint(out + count, micros / 1000000);
+  out[count++] = '.';
+
+  micros %= 1000000;
+  memcpy(out + count, &mems_decimal_pairs[(micros / 10000) * 2], 2);
+  memcpy(out + count + 2, &mems_decimal_pairs[((micros / 100) % 100) * 2], 2);
+  memcpy(out + count + 4, &mems_decimal_pairs[(micros % 100) * 2], 2);
+
+  return count + 6;
+}
+
+/**
+ * Writes a raw frame's hex string prefixed with the frame's command.
+ * @return Number of characters written (no terminator)
+ */
+static size_t mems_format_raw(char *out, uint8_t frame, const char *hex)
+{
+  size_t count = strlen(hex);
+
+  if (count > (MEMS_FORMAT_SCRATCH - 4))
+  {
+    count = MEMS_FORMAT_SCRATCH - 4;
+  }
+
+  memcpy(out, mems_frame_label(frame), 2);
+  memcpy(out + 2, hex, count);
+
+  return count + 2;
+}
+
+/**
+ * Encodes bytes as lowercase hex, two characters per byte, followed by a
+ * terminator.
+ * @param buffer Receives the text; must have room for (count * 2) + 1 characters
+ * @param bytes Bytes to encode
+ * @param count Number of bytes
+ * @return The buffer
+ */
+char *mems_format_hex(char *buffer, const uint8_t *bytes, size_t count)
+{
+  size_t idx;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    buffer[idx * 2] = mems_hex_digits[bytes[idx] >> 4];
+    buffer[(idx * 2) + 1] = mems_hex_digits[bytes[idx] & 0x0F];
+  }
+  buffer[count * 2] = 0;
+
+  return buffer;
+}
+
+/**
+ * Appends the column label of a field, e.g. "80x01-02_engine-rpm".
+ */
+static size_t mems_format_label(char *buffer, size_t size, size_t len, const char *separator, mems_field field)
+{
+  const mems_field_descriptor *desc = &mems_field_descriptors[field];
+
+  switch (desc->kind)
+  {
+  case MEMS_Kind_Raw:
+    return mems_format_append(buffer, size, len, "%s0x%s_%s", separator, mems_frame_label(desc->frame), desc->name);
+  case MEMS_Kind_Word:
+  case MEMS_Kind_Faults:
+    return mems_format_append(buffer, size, len, "%s%sx%02X-%02X_%s", separator, mems_frame_label(desc->frame),
+                              desc->offset, desc->offset + 1, desc->name);
+  default:
+    return mems_format_append(buffer, size, len, "%s%sx%02X_%s", separator, mems_frame_label(desc->frame),
+                              desc->offset, desc->name);
+  }
+}
+
+/**
+ * Describes a field of mems_data: its names and how it is decoded.
+ * @param field Field index, e.g. MEMS_Field_engine_rpm
+ * @return Descriptor, or NULL if the index is out of range
+ */
+const mems_field_descriptor *mems_describe_field(mems_field field)
+{
+  if (((int)field < 0) || (field >= MEMS_Field_Count))
+  {
+    return NULL;
+  }
+
+  return &mems_field_descriptors[field];
+}
+
+/**
+ * Formats the log column label of a field: the frame, the offset of the
+ * byte(s) it is decoded from and its published name, e.g.
+ * "80x01-02_engine-rpm" or "7dx02_throttle_angle".
+ * @param field Field index, e.g. MEMS_Field_engine_rpm
+ * @param buffer Receives the label
+ * @param size Size of the buffer
+ * @return Length of the label; if this is not less than size, the label
+ *   was truncated
+ */
+size_t mems_field_label(mems_field field, char *buffer, size_t size)
+{
+  if (size > 0)
+  {
+    buffer[0] = 0;
+  }
+
+  if (mems_describe_field(field) == NULL)
+  {
+    return 0;
+  }
+
+  return mems_format_label(buffer, size, 0, "", field);
+}
+
+/**
+ * Formats the comma-separated column labels for a set of fields, in the
+ * order of MEMS_DATA_FIELDS. MEMS_CSV_FIELDS gives the columns of the
+ * MEMS-Scan log, which readmems precedes with a time column.
+ * @param fields Mask of MEMS_FIELD() bits
+ * @param buffer Receives the labels, without a line ending
+ * @param size Size of the buffer
+ * @return Length of the text; if this is not less than size, the text was
+ *   truncated
+ */
+size_t mems_format_csv_header(uint64_t fields, char *buffer, size_t size)
+{
+  const char *separator = "";
+  size_t len = 0;
+  int idx;
+
+  if (size > 0)
+  {
+    buffer[0] = 0;
+  }
+
+  for (idx = 0; idx < MEMS_Field_Count; idx++)
+  {
+    if (fields & ((uint64_t)1 << idx))
+    {
+      len = mems_format_label(buffer, size, len, separator, (mems_field)idx);
+      separator = ",";
+    }
+  }
+
+  return len;
+}
+
+/**
+ * Formats the values of a set of fields as one comma-separated line, in
+ * the same order as mems_format_csv_header().
+ * @param data Decoded sample
+ * @param fields Mask of MEMS_FIELD() bits
+ * @param buffer Receives the values, without a line ending
+ * @param size Size of the buffer
+ * @return Length of the text; if this is not less than size, the text was
+ *   truncated
+ */
+size_t mems_format_csv(const mems_data *data, uint64_t fields, char *buffer, size_t size)
+{
+  char scratch[MEMS_FORMAT_SCRATCH];
+  char *out;
+  size_t count;
+  size_t len = 0;
+
+  // values are written straight into the buffer while it has room for any
+  // value, and through the scratch buffer (to be truncated) once it does not
+#define MEMS_CSV_VALUE(member, type, frame, offset, kind, scale, bias, name) \
+  if (fields & MEMS_FIELD(member))                                           \
+  {                                                                          \
+    out = ((len + MEMS_FORMAT_SCRATCH) < size) ? (buffer + len) : scratch;   \
+    count = 0;                                                               \
+    if (len != 0)                                                            \
+    {                                                                        \
+      out[count++] = ',';                                                    \
+    }                                                                        \
+    count += MEMS_CSV_##type(out + count, data->member, frame);              \
+    if (out == scratch)                                                      \
+    {                                                                        \
+      len = mems_format_copy(buffer, size, len, scratch, count);             \
+    }                                                                        \
+    else                                                                     \
+    {                                                                        \
+      len += count;                                                          \
+      buffer[len] = 0;                                                       \
+    }                                                                        \
+  }
+
+  MEMS_DATA_FIELDS(MEMS_CSV_VALUE)
+
+#undef MEMS_CSV_VALUE
+
+  if ((len == 0) && (size > 0))
+  {
+    buffer[0] = 0;
+  }
+
+  return len;
+}
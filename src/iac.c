@@ -0,0 +1,223 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// iac.c: This file contains the idle air control motion engine,
+//        which streams step commands to the ECU back-to-back
+//        under a single lock rather than one round trip per step.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Most step commands sent before their replies are read
+#define MEMS_IAC_BURST 16
+
+/**
+ * Sends a burst of identical step commands in one write and reads the
+ * echo/position pair returned for each.
+ * @param positions Receives the position reported after each step
+ * @return Number of steps acknowledged, in order
+ */
+static uint16_t mems_iac_burst(mems_info *info, uint8_t cmd, uint16_t count, uint8_t *positions, uint64_t deadline_us)
+{
+  uint8_t commands[MEMS_IAC_BURST];
+  uint8_t replies[MEMS_IAC_BURST * 2];
+  int16_t received;
+  uint16_t idx;
+
+  memset(commands, cmd, count);
+
+  if (mems_write_serial(info, commands, count) != count)
+  {
+    dprintf_err("mems_iac_move(): failed to send %u step commands\n", count);
+    return 0;
+  }
+
+  received = mems_read_serial_timed(info, replies, count * 2, deadline_us);
+
+  for (idx = 0; ((idx * 2) + 1) < received; idx++)
+  {
+    if (replies[idx * 2] != cmd)
+    {
+      dprintf_err("mems_iac_move(): received nonmatching byte (%02X) in response to step command %02X\n", replies[idx * 2], cmd);
+      break;
+    }
+    positions[idx] = replies[(idx * 2) + 1];
+  }
+
+  return idx;
+}
+
+/**
+ * Picks the direction of the extra steps sent once the target is reached:
+ * further into the end of travel if the target is closed or fully open,
+ * otherwise on in the direction of the move.
+ */
+static uint8_t mems_iac_extra_command(uint8_t desired_pos, uint8_t start_pos)
+{
+  if (desired_pos == 0)
+  {
+    return MEMS_CloseIAC;
+  }
+
+  if ((desired_pos >= IAC_MAXIMUM) || (desired_pos > start_pos))
+  {
+    return MEMS_OpenIAC;
+  }
+
+  if (desired_pos < start_pos)
+  {
+    return MEMS_CloseIAC;
+  }
+
+  // already at the target; continue toward the nearer end of travel
+  return (desired_pos >= (IAC_MAXIMUM / 2)) ? MEMS_OpenIAC : MEMS_CloseIAC;
+}
+
+/**
+ * Moves the idle air control valve to the desired position. Step commands
+ * are streamed in bursts no larger than the remaining distance (so the
+ * valve cannot overshoot if it moves at most one step per command) while
+ * the connection mutex is held once for the whole move. The position
+ * reported in reply to each step is tracked, and the move ends when the
+ * target is reached, the valve stops moving, the end of travel is reached,
+ * or the deadline passes.
+ * @param info State information for the current connection.
+ * @param desired_pos Target position (0 = closed, IAC_MAXIMUM = open)
+ * @param extra_steps Additional step commands to send once the target is
+ *   reached, as diagnostic tools do to seat a closed valve (at most
+ *   MEMS_IAC_MAX_EXTRA_STEPS, counted separately from the move). They
+ *   close a valve sent to 0 and open one sent to IAC_MAXIMUM; for other
+ *   targets they continue in the direction of the move.
+ * @param deadline_us Absolute deadline for the whole move, or MEMS_NO_DEADLINE
+ * @param result Receives the outcome of the move; may be NULL
+ * @return True if the valve reached the desired position
+ */
+bool mems_iac_move(mems_info *info, uint8_t desired_pos, uint16_t extra_steps, uint64_t deadline_us, mems_iac_result *result)
+{
+  mems_iac_result outcome;
+  mems_command read_position = {MEMS_GetIACPosition, 1, NULL, false};
+  uint8_t positions[MEMS_IAC_BURST];
+  uint8_t current_pos = 0;
+  uint8_t cmd;
+  uint8_t extra_cmd;
+  uint16_t burst_limit = MEMS_IAC_BURST;
+  uint16_t move_steps = 0;
+  uint16_t remaining;
+  uint16_t count;
+  uint16_t acked;
+  uint16_t unchanged = 0;
+  uint16_t idx;
+  bool arrived;
+  uint64_t started_us = mems_monotonic_us();
+
+  memset(&outcome, 0, sizeof(mems_iac_result));
+  read_position.reply = &current_pos;
+
+  if (extra_steps > MEMS_IAC_MAX_EXTRA_STEPS)
+  {
+    extra_steps = MEMS_IAC_MAX_EXTRA_STEPS;
+  }
+
+  if (mems_lock(info))
+  {
+    if (mems_transact_locked(info, &read_position, 1, deadline_us) == 1)
+    {
+      outcome.start_position = current_pos;
+      extra_cmd = mems_iac_extra_command(desired_pos, current_pos);
+      arrived = (current_pos == desired_pos);
+
+      while ((!arrived || (extra_steps > 0)) && !outcome.stalled &&
+             ((deadline_us == MEMS_NO_DEADLINE) || (mems_monotonic_us() < deadline_us)))
+      {
+        if (!arrived)
+        {
+          // the valve may move more than one step per command and overshoot
+          cmd = (desired_pos > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
+
+          // stop at the end of travel rather than stepping against the stop
+          if (((cmd == MEMS_OpenIAC) && (current_pos >= IAC_MAXIMUM)) ||
+              ((cmd == MEMS_CloseIAC) && (current_pos == 0)) ||
+              (move_steps >= MEMS_IAC_MAX_STEPS))
+          {
+            break;
+          }
+
+          remaining = (desired_pos > current_pos) ? (desired_pos - current_pos) : (current_pos - desired_pos);
+          if (remaining > (MEMS_IAC_MAX_STEPS - move_steps))
+          {
+            remaining = MEMS_IAC_MAX_STEPS - move_steps;
+          }
+        }
+        else
+        {
+          // once there, the extra steps go on regardless of position
+          cmd = extra_cmd;
+          remaining = extra_steps;
+        }
+
+        count = (remaining < burst_limit) ? remaining : burst_limit;
+
+        acked = mems_iac_burst(info, cmd, count, positions, deadline_us);
+
+        for (idx = 0; idx < acked; idx++)
+        {
+          if (arrived)
+          {
+            extra_steps -= 1;
+          }
+          else
+          {
+            unchanged = (positions[idx] == current_pos) ? (unchanged + 1) : 0;
+            move_steps += 1;
+          }
+          current_pos = positions[idx];
+        }
+
+        outcome.steps += acked;
+
+        if (acked < count)
+        {
+          // the rest of the burst's replies may still be on their way, and
+          // would otherwise be read as the reply to the next command
+          if (!mems_resync_locked(info, deadline_us) || (acked == 0))
+          {
+            break;
+          }
+
+          // the ECU dropped commands sent back-to-back; continue one at a time
+          burst_limit = 1;
+        }
+
+        if (!arrived)
+        {
+          arrived = (current_pos == desired_pos);
+
+          // the valve hasn't moved for a while; it is not going to
+          if (!arrived && (unchanged >= MEMS_IAC_STALL_STEPS))
+          {
+            outcome.stalled = true;
+          }
+        }
+      }
+
+      outcome.reached = arrived;
+    }
+    else
+    {
+      dprintf_err("mems_iac_move(): failed to read the current IAC position\n");
+    }
+
+    mems_unlock(info);
+  }
+
+  outcome.final_position = current_pos;
+  outcome.elapsed_us = mems_monotonic_us() - started_us;
+
+  if (result)
+  {
+    memcpy(result, &outcome, sizeof(mems_iac_result));
+  }
+
+  return outcome.reached;
+}
@@ -0,0 +1,143 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// loopback.c: This file contains the loopback transport, which
+//             answers commands from a simulated ECU in memory so
+//             that the protocol and decoding can be exercised (and
+//             profiled) without a device or the kernel tty layer.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Bytes of replies that can wait to be read; enough for a burst of commands
+#define MEMS_LOOPBACK_BUFFER 512
+
+/**
+ * State of a loopback connection: the simulated ECU and the replies it has
+ * sent that have not yet been read.
+ */
+typedef struct
+{
+  mems_ecusim ecu;
+  uint8_t buffer[MEMS_LOOPBACK_BUFFER];
+  uint16_t start;
+  uint16_t end;
+} mems_loopback;
+
+static bool mems_loopback_open(mems_info *info, const char *path)
+{
+  mems_loopback *loopback = (mems_loopback *)malloc(sizeof(mems_loopback));
+
+  (void)path;
+
+  if (loopback == NULL)
+  {
+    return false;
+  }
+
+  memset(loopback, 0, sizeof(mems_loopback));
+  mems_ecusim_init(&loopback->ecu, true);
+  info->transport_state = loopback;
+
+  return true;
+}
+
+static void mems_loopback_close(mems_info *info)
+{
+  free(info->transport_state);
+  info->transport_state = NULL;
+}
+
+static bool mems_loopback_is_open(mems_info *info)
+{
+  return (info->transport_state != NULL);
+}
+
+/**
+ * Passes each command to the simulated ECU and queues its reply. Replies
+ * that do not fit are lost, as they would be by a UART that was not read.
+ */
+static int16_t mems_loopback_write(mems_info *info, const uint8_t *buffer, uint16_t quantity)
+{
+  mems_loopback *loopback = (mems_loopback *)info->transport_state;
+  uint8_t reply[MEMS_ECUSIM_MAX_REPLY];
+  size_t len;
+  uint16_t idx;
+
+  for (idx = 0; idx < quantity; idx++)
+  {
+    len = mems_ecusim_respond(&loopback->ecu, buffer[idx], reply);
+
+    // move unread bytes to the front to make room
+    if ((loopback->end + len) > MEMS_LOOPBACK_BUFFER)
+    {
+      memmove(loopback->buffer, loopback->buffer + loopback->start, loopback->end - loopback->start);
+      loopback->end -= loopback->start;
+      loopback->start = 0;
+    }
+
+    if ((loopback->end + len) <= MEMS_LOOPBACK_BUFFER)
+    {
+      memcpy(loopback->buffer + loopback->end, reply, len);
+      loopback->end += len;
+    }
+  }
+
+  return quantity;
+}
+
+static int16_t mems_loopback_read(mems_info *info, uint8_t *buffer, uint16_t quantity)
+{
+  mems_loopback *loopback = (mems_loopback *)info->transport_state;
+  uint16_t count = loopback->end - loopback->start;
+
+  if (count > quantity)
+  {
+    count = quantity;
+  }
+
+  memcpy(buffer, loopback->buffer + loopback->start, count);
+  loopback->start += count;
+
+  if (loopback->start == loopback->end)
+  {
+    loopback->start = 0;
+    loopback->end = 0;
+  }
+
+  return count;
+}
+
+/**
+ * Replies are queued as soon as a command is written, so there is never
+ * anything to wait for.
+ */
+static bool mems_loopback_wait_readable(mems_info *info, uint64_t timeout_us)
+{
+  mems_loopback *loopback = (mems_loopback *)info->transport_state;
+
+  (void)timeout_us;
+
+  return (loopback->end > loopback->start);
+}
+
+static void mems_loopback_flush(mems_info *info)
+{
+  mems_loopback *loopback = (mems_loopback *)info->transport_state;
+
+  loopback->start = 0;
+  loopback->end = 0;
+}
+
+const mems_transport mems_transport_loopback = {
+    "loopback",
+    mems_loopback_open,
+    mems_loopback_close,
+    mems_loopback_is_open,
+    mems_loopback_read,
+    mems_loopback_write,
+    mems_loopback_wait_readable,
+    mems_loopback_flush,
+    false};
@@ -0,0 +1,271 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// memssim.c: Simulates a MEMS 1.6 ECU on a pseudo-terminal so that
+//            the library and readmems can be exercised (and timed)
+//            without a car on the bench.
+
+// posix_openpt(), ptsname() and cfmakeraw()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <libgen.h>
+#include <poll.h>
+
+#include "rosco.h"
+
+/**
+ * Timing of the pty link.
+ */
+typedef struct
+{
+  long byte_latency_us;
+  long turnaround_us;
+  bool verbose;
+  bool drop_while_busy;
+  unsigned long noise_every;
+  unsigned long replies;
+} sim_link;
+
+static volatile sig_atomic_t sim_quit = 0;
+
+static void sim_signal(int sig)
+{
+  (void)sig;
+  sim_quit = 1;
+}
+
+static uint64_t sim_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void sim_sleep_until_us(uint64_t when)
+{
+  struct timespec ts;
+
+  ts.tv_sec = when / 1000000;
+  ts.tv_nsec = (when % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+  {
+    if (sim_quit)
+      break;
+  }
+}
+
+/**
+ * Writes a reply to the pty master, pacing each byte by the configured
+ * per-byte latency to model the 9600 baud line.
+ */
+static bool sim_send(int fd, sim_link *link, const uint8_t *reply, size_t len)
+{
+  uint64_t when = sim_now_us() + link->turnaround_us;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (link->turnaround_us || link->byte_latency_us)
+      sim_sleep_until_us(when);
+
+    // discard anything the client sent before the reply was complete; this
+    // must happen before the final byte, as the client may answer that at once
+    if (link->drop_while_busy && (i == len - 1))
+      tcflush(fd, TCIFLUSH);
+
+    if (write(fd, &reply[i], 1) != 1)
+      return false;
+
+    when += link->byte_latency_us;
+  }
+
+  // a stray byte after the reply, as line noise would produce
+  link->replies += 1;
+  if (link->noise_every && ((link->replies % link->noise_every) == 0))
+  {
+    if (write(fd, "\x55", 1) != 1)
+      return false;
+  }
+
+  return true;
+}
+
+static void sim_usage(const char *name)
+{
+  printf("mems-sim: MEMS 1.6 ECU simulator for librosco\n");
+  printf("Usage: %s [-l byte-latency-us] [-t turnaround-us] [-s symlink] [-n replies] [-o] [-p] [-v]\n", name);
+  printf("  -l  delay between each byte sent by the ECU in us (default 1042, ~9600 baud; 0 = no delay)\n");
+  printf("  -t  delay between receiving a command and starting the reply in us (default 0)\n");
+  printf("  -s  create a symlink to the pty slave (e.g. ttyecu)\n");
+  printf("  -n  send a stray byte after every n replies to simulate line noise (default 0 = never)\n");
+  printf("  -o  simulate ignition on with the engine stopped\n");
+  printf("  -p  ignore commands that arrive while a reply is being sent (no pipelining)\n");
+  printf("  -v  print every command received\n");
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int master;
+  int slave;
+  char *slave_path;
+  char *link_path = NULL;
+  bool engine_running = true;
+  struct termios tio;
+  struct pollfd pfd;
+  mems_ecusim ecu;
+  sim_link link;
+  uint8_t cmd;
+  uint8_t reply[MEMS_ECUSIM_MAX_REPLY];
+  size_t reply_len;
+  uint64_t stats_start;
+  uint64_t now;
+  uint32_t last80 = 0;
+  uint32_t last7d = 0;
+  ssize_t n;
+
+  memset(&link, 0, sizeof(sim_link));
+  link.byte_latency_us = 1042;
+
+  while ((opt = getopt(argc, argv, "l:t:s:n:opvh")) != -1)
+  {
+    switch (opt)
+    {
+    case 'l':
+      link.byte_latency_us = strtol(optarg, NULL, 0);
+      break;
+    case 't':
+      link.turnaround_us = strtol(optarg, NULL, 0);
+      break;
+    case 's':
+      link_path = optarg;
+      break;
+    case 'o':
+      engine_running = false;
+      break;
+    case 'n':
+      link.noise_every = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      link.drop_while_busy = true;
+      break;
+    case 'v':
+      link.verbose = true;
+      break;
+    default:
+      sim_usage(basename(argv[0]));
+      return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0) ||
+      ((slave_path = ptsname(master)) == NULL))
+  {
+    perror("mems-sim: unable to create pty");
+    return -1;
+  }
+
+  // keep a handle on the slave side so that the master does not see a
+  // hangup each time a client closes the port
+  slave = open(slave_path, O_RDWR | O_NOCTTY);
+  if (slave < 0)
+  {
+    perror("mems-sim: unable to open pty slave");
+    return -1;
+  }
+
+  // the ECU neither echoes through the line discipline nor translates CR/LF
+  if (tcgetattr(slave, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+  }
+
+  if (link_path)
+  {
+    unlink(link_path);
+    if (symlink(slave_path, link_path) != 0)
+    {
+      perror("mems-sim: unable to create symlink");
+      return -1;
+    }
+  }
+
+  signal(SIGINT, sim_signal);
+  signal(SIGTERM, sim_signal);
+
+  mems_ecusim_init(&ecu, engine_running);
+
+  printf("mems-sim: ECU listening on %s%s%s (byte latency %ldus, turnaround %ldus)\n",
+         slave_path, link_path ? " -> " : "", link_path ? link_path : "",
+         link.byte_latency_us, link.turnaround_us);
+  fflush(stdout);
+
+  pfd.fd = master;
+  pfd.events = POLLIN;
+  stats_start = sim_now_us();
+
+  while (!sim_quit)
+  {
+    if (poll(&pfd, 1, 1000) > 0)
+    {
+      n = read(master, &cmd, 1);
+      if (n == 1)
+      {
+        if (link.verbose)
+          printf("mems-sim: rx %02X\n", cmd);
+
+        reply_len = mems_ecusim_respond(&ecu, cmd, reply);
+        if ((reply_len > 0) && !sim_send(master, &link, reply, reply_len))
+        {
+          perror("mems-sim: write failed");
+        }
+
+      }
+      else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR))
+      {
+        perror("mems-sim: read failed");
+        break;
+      }
+    }
+
+    // report the rate at which frames were requested over the last second
+    now = sim_now_us();
+    if ((now - stats_start) >= 1000000)
+    {
+      if ((ecu.frames80 != last80) || (ecu.frames7d != last7d))
+      {
+        printf("mems-sim: %.1f 0x80 frames/s, %.1f 0x7D frames/s\n",
+               (ecu.frames80 - last80) * 1000000.0 / (now - stats_start),
+               (ecu.frames7d - last7d) * 1000000.0 / (now - stats_start));
+        fflush(stdout);
+      }
+      last80 = ecu.frames80;
+      last7d = ecu.frames7d;
+      stats_start = now;
+    }
+  }
+
+  printf("mems-sim: %u commands, %u 0x80 frames, %u 0x7D frames\n",
+         ecu.commands, ecu.frames80, ecu.frames7d);
+
+  if (link_path)
+    unlink(link_path);
+
+  close(slave);
+  close(master);
+
+  return 0;
+}
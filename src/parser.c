@@ -0,0 +1,135 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// parser.c: This file contains an incremental parser that
+//           recovers 0x80/0x7D data frames from a stream of
+//           bytes received from the ECU, independently of how
+//           those bytes were read.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Returns the value of bytes_in_frame expected in the reply to a data request.
+ * @param cmd Echoed command byte
+ * @return Size of the frame that follows the echo, or 0 if cmd is not a data request
+ */
+static uint8_t mems_parser_frame_size(uint8_t cmd)
+{
+  if (cmd == MEMS_ReqData80)
+    return sizeof(mems_data_frame_80);
+
+  if (cmd == MEMS_ReqData7D)
+    return sizeof(mems_data_frame_7d);
+
+  return 0;
+}
+
+/**
+ * Treats the byte as the echo of a data request if it is one, otherwise
+ * drops into resynchronisation.
+ */
+static void mems_parser_echo(mems_parser *parser, uint8_t byte)
+{
+  uint8_t size = mems_parser_frame_size(byte);
+
+  if (size)
+  {
+    parser->command = byte;
+    parser->expected = size;
+    parser->pos = 0;
+    parser->state = MEMS_Parse_Length;
+  }
+  else
+  {
+    if (parser->state != MEMS_Parse_Resync)
+    {
+      parser->resyncs += 1;
+      parser->state = MEMS_Parse_Resync;
+    }
+    parser->discarded += 1;
+  }
+}
+
+/**
+ * Resets the parser to wait for the echo of a data request.
+ * @param parser Parser state
+ */
+void mems_parser_init(mems_parser *parser)
+{
+  memset(parser, 0, sizeof(mems_parser));
+  parser->state = MEMS_Parse_Echo;
+}
+
+/**
+ * Feeds received bytes to the parser. Parsing stops at the end of the first
+ * complete frame, which is then available in parser->frame until the next
+ * call. A frame is accepted only if it follows the echo of 0x80 or 0x7D and
+ * its first byte (bytes_in_frame) matches the size of that frame; anything
+ * else is discarded until the next plausible echo.
+ * @param parser Parser state
+ * @param data Bytes received from the ECU
+ * @param len Number of bytes in data
+ * @param command Set to the command (MEMS_ReqData80 or MEMS_ReqData7D) whose
+ *   frame was completed, or 0 if all of data was consumed without completing one
+ * @return Number of bytes consumed from data
+ */
+size_t mems_parser_feed(mems_parser *parser, const uint8_t *data, size_t len, uint8_t *command)
+{
+  size_t idx = 0;
+  size_t count;
+  uint8_t byte;
+
+  *command = 0;
+
+  while (idx < len)
+  {
+    switch (parser->state)
+    {
+    case MEMS_Parse_Echo:
+    case MEMS_Parse_Resync:
+      mems_parser_echo(parser, data[idx++]);
+      break;
+
+    case MEMS_Parse_Length:
+      byte = data[idx++];
+      if (byte == parser->expected)
+      {
+        parser->frame.bytes[0] = byte;
+        parser->pos = 1;
+        parser->state = MEMS_Parse_Payload;
+      }
+      else
+      {
+        // the previous byte was not a genuine echo, but this one may be
+        parser->discarded += 1;
+        parser->state = MEMS_Parse_Resync;
+        parser->resyncs += 1;
+        mems_parser_echo(parser, byte);
+      }
+      break;
+
+    case MEMS_Parse_Payload:
+      // copy as much of the payload as is available in one go
+      count = parser->expected - parser->pos;
+      if (count > (len - idx))
+        count = len - idx;
+
+      memcpy(parser->frame.bytes + parser->pos, data + idx, count);
+      parser->pos += count;
+      idx += count;
+
+      if (parser->pos == parser->expected)
+      {
+        parser->frames += 1;
+        parser->state = MEMS_Parse_Echo;
+        *command = parser->command;
+        return idx;
+      }
+      break;
+    }
+  }
+
+  return idx;
+}
@@ -18,63 +18,145 @@
 #include <string.h>
 #endif
 
+#if !defined(WIN32)
+#include <errno.h>
+#endif
+
 #include "rosco.h"
 #include "rosco_internal.h"
 
-char *convert_dataframe_to_string(char *buf, void *dframe, int size)    
+/**
+ * Encodes a raw data frame as a hex string.
+ */
+char *convert_dataframe_to_string(char *buf, const void *dframe, int size)
+{
+  return mems_format_hex(buf, (const uint8_t *)dframe, (size_t)size);
+}
+
+/**
+ * Reads from the transport, waiting for data before each read until either
+ * the requested quantity has arrived or the deadline has passed. Because a
+ * read is only made once data is waiting, this never blocks beyond the
+ * deadline, whether or not the device was opened O_NONBLOCK.
+ * @param deadline_us Absolute time (from mems_monotonic_us()) at which to give up
+ * @return Number of bytes read
+ */
+static int16_t mems_read_serial_poll(mems_info *info, uint8_t *buffer, uint16_t quantity, uint64_t deadline_us)
 {
-  unsigned int len = 0; 
+  int16_t totalBytesRead = 0;
+  int16_t bytesRead;
+  uint64_t now;
+
+  while (totalBytesRead < quantity)
+  {
+    now = mems_monotonic_us();
+    if ((now >= deadline_us) || !info->transport->wait_readable(info, deadline_us - now))
+    {
+      break;
+    }
 
-  for (int i=0; i<size; i++) {
-    unsigned char *b = (unsigned char *)&dframe[i];
-    len += sprintf(buf + len, "%02x", *b);
+    bytesRead = info->transport->read(info, buffer + totalBytesRead, quantity - totalBytesRead);
+
+    if (bytesRead > 0)
+    {
+      totalBytesRead += bytesRead;
+    }
+#if !defined(WIN32)
+    else if ((bytesRead < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+    {
+      break;
+    }
+#endif
   }
 
-  return buf;
+  return totalBytesRead;
 }
 
 /**
- * Reads bytes from the serial device using an OS-specific call.
+ * Reads bytes from the ECU through the connection's transport.
+ * In non-blocking mode, the reply must be complete within the read timeout
+ * plus the time needed to transfer the requested bytes at 9600 baud.
  * @param buffer Buffer into which data should be read
  * @param quantity Number of bytes to read
  * @return Number of bytes read from the device, or -1 if no bytes could be read
  */
 int16_t mems_read_serial(mems_info *info, uint8_t *buffer, uint16_t quantity)
+{
+  return mems_read_serial_timed(info, buffer, quantity, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads bytes from the serial device, giving up at the specified deadline.
+ * @param buffer Buffer into which data should be read
+ * @param quantity Number of bytes to read
+ * @param deadline_us Absolute time (from mems_monotonic_us()) at which to
+ *   give up, or MEMS_NO_DEADLINE to use the timeout configured for the port
+ * @return Number of bytes read from the device, or -1 if no bytes could be read
+ */
+int16_t mems_read_serial_timed(mems_info *info, uint8_t *buffer, uint16_t quantity, uint64_t deadline_us)
+{
+  int16_t totalBytesRead = mems_read_serial_quiet(info, buffer, quantity, deadline_us);
+
+  if (totalBytesRead < quantity)
+  {
+    dprintf_err("mems_read_serial(): expected %d, got %d\n", quantity, totalBytesRead);
+  }
+
+  return totalBytesRead;
+}
+
+/**
+ * Reads bytes as mems_read_serial_timed() does, without reporting a short
+ * read, for callers that expect reads to fail and count the failures
+ * themselves.
+ */
+int16_t mems_read_serial_quiet(mems_info *info, uint8_t *buffer, uint16_t quantity, uint64_t deadline_us)
 {
   int16_t totalBytesRead = 0;
   int16_t bytesRead = -1;
   uint8_t *buffer_pt = buffer;
+  bool wait_for_data;
 
-  if (mems_is_connected(info))
+  if (!mems_is_connected(info))
+  {
+    return 0;
+  }
+
+  // waiting also works on a blocking descriptor: once data is waiting, a
+  // VMIN=0 read() returns immediately with whatever has arrived
+  wait_for_data = (deadline_us != MEMS_NO_DEADLINE) || !info->transport->has_fd;
+#if !defined(WIN32)
+  wait_for_data = wait_for_data || info->nonblocking;
+#endif
+
+  if (wait_for_data)
+  {
+    if (deadline_us == MEMS_NO_DEADLINE)
+    {
+      deadline_us = mems_monotonic_us() +
+                    ((uint64_t)info->read_timeout_ms * 1000) +
+                    ((uint64_t)quantity * MEMS_BYTE_TIME_US);
+    }
+    totalBytesRead = mems_read_serial_poll(info, buffer, quantity, deadline_us);
+  }
+  else
   {
     do
     {
-#if defined(WIN32)
-      DWORD w32BytesRead = 0;
-      if ((ReadFile(info->sd, (UCHAR *)buffer_pt, quantity, &w32BytesRead, NULL) == TRUE) &&
-          (w32BytesRead > 0))
+      bytesRead = info->transport->read(info, buffer_pt, quantity - totalBytesRead);
+      if (bytesRead > 0)
       {
-        bytesRead = w32BytesRead;
+        totalBytesRead += bytesRead;
+        buffer_pt += bytesRead;
       }
-#else
-      bytesRead = read(info->sd, buffer_pt, quantity);
-#endif
-      totalBytesRead += bytesRead;
-      buffer_pt += bytesRead;
-
     } while ((bytesRead > 0) && (totalBytesRead < quantity));
   }
 
-  if (totalBytesRead < quantity)
-  {
-    dprintf_err("mems_read_serial(): expected %d, got %d\n", quantity, totalBytesRead);
-  }
-
   return totalBytesRead;
 }
 
 /**
- * Writes bytes to the serial device using an OS-specific call
+ * Writes bytes to the ECU through the connection's transport.
  * @param buffer Buffer from which written data should be drawn
  * @param quantity Number of bytes to write
  * @return Number of bytes written to the device, or -1 if no bytes could be written
@@ -85,16 +167,7 @@ int16_t mems_write_serial(mems_info *info, uint8_t *buffer, uint16_t quantity)
 
   if (mems_is_connected(info))
   {
-#if defined(WIN32)
-    DWORD w32BytesWritten = 0;
-    if ((WriteFile(info->sd, (UCHAR *)buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
-        (w32BytesWritten == quantity))
-    {
-      bytesWritten = w32BytesWritten;
-    }
-#else
-    bytesWritten = write(info->sd, buffer, quantity);
-#endif
+    bytesWritten = info->transport->write(info, buffer, quantity);
   }
 
   return bytesWritten;
@@ -107,13 +180,22 @@ int16_t mems_write_serial(mems_info *info, uint8_t *buffer, uint16_t quantity)
  * be called to retrieve that data from the input buffer.
  */
 bool mems_send_command(mems_info *info, uint8_t cmd)
+{
+  return mems_send_command_timed(info, cmd, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Sends a single command byte to the ECU and waits until the deadline for
+ * the same byte to be echoed as a response.
+ */
+bool mems_send_command_timed(mems_info *info, uint8_t cmd, uint64_t deadline_us)
 {
   bool result = false;
   uint8_t response = 0xFF;
 
   if (mems_write_serial(info, &cmd, 1) == 1)
   {
-    if (mems_read_serial(info, &response, 1) == 1)
+    if (mems_read_serial_timed(info, &response, 1, deadline_us) == 1)
     {
       if (response == cmd)
       {
@@ -137,54 +219,199 @@ bool mems_send_command(mems_info *info, uint8_t cmd)
   return result;
 }
 
+/**
+ * Sends a command byte and waits for its echo as mems_send_command_timed()
+ * does, without reporting a failure.
+ * @return True if the command was echoed by the deadline
+ */
+bool mems_send_command_quiet(mems_info *info, uint8_t cmd, uint64_t deadline_us)
+{
+  uint8_t response = 0xFF;
+
+  return (mems_write_serial(info, &cmd, 1) == 1) &&
+         (mems_read_serial_quiet(info, &response, 1, deadline_us) == 1) &&
+         (response == cmd);
+}
+
 /**
  * Sends an initialization/startup sequence to the ECU. Required to enable further communication.
  */
 bool mems_init_link(mems_info *info, uint8_t *d0_response_buffer)
 {
-  uint8_t command_a = 0xCA;
-  uint8_t command_b = 0x75;
-  uint8_t command_c = MEMS_Heartbeat;
-  uint8_t command_d = 0xD0;
-  uint8_t buffer = 0x00;
+  uint8_t heartbeat_response = 0x00;
+  int completed;
+
+  // Expect a null terminator after the echo of the heartbeat, and four
+  // more bytes after the echo of the D0 command byte.
+  // Response to D0 is 99 00 03 03 for Mini SPi.
+  mems_command sequence[] = {
+      {0xCA, 0, NULL, false},
+      {0x75, 0, NULL, false},
+      {MEMS_Heartbeat, 1, &heartbeat_response, false},
+      {0xD0, 4, d0_response_buffer, false}};
 
-  if (!mems_send_command(info, command_a))
+  completed = mems_transact(info, sequence, sizeof(sequence) / sizeof(sequence[0]), MEMS_NO_DEADLINE);
+
+  if (completed < 0)
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_a);
+    dprintf_err("mems_init_link(): could not lock the connection\n");
     return false;
   }
-  if (!mems_send_command(info, command_b))
+
+  if (completed < (int)(sizeof(sequence) / sizeof(sequence[0])))
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_b);
+    dprintf_err("mems_init_link(): Did not see complete response to %02X command\n", sequence[completed].command);
     return false;
   }
-  if (!mems_send_command(info, command_c))
+
+  // keep the D0 reply so that a later reconnect can skip the handshake
+  memcpy(info->d0_response, d0_response_buffer, sizeof(info->d0_response));
+  info->d0_cached = true;
+
+  return true;
+}
+
+/**
+ * Initialises the link, skipping the full startup sequence if the ECU is
+ * still in a diagnostic session started earlier (e.g. by a previous run of
+ * the same program). A heartbeat is sent with a short deadline; a live
+ * session answers it at once, while a cold ECU ignores it, in which case
+ * the full sequence is sent as mems_init_link() does.
+ * @param info State information for the current connection.
+ * @param d0_response_buffer Receives the four bytes of the D0 reply; when
+ *   the session is resumed, these are the cached reply (see
+ *   mems_set_d0_response()), or are requested again if none is cached
+ * @param probe_ms Time allowed for the heartbeat (e.g. MEMS_DEFAULT_PROBE_MS)
+ * @param resumed Set to true if the existing session was resumed, or false
+ *   if the full sequence was sent; may be NULL
+ * @return True if the link is ready for use
+ */
+bool mems_init_link_fast(mems_info *info, uint8_t *d0_response_buffer, uint32_t probe_ms, bool *resumed)
+{
+  uint8_t d0_response[4];
+  mems_command d0 = {0xD0, 4, NULL, false};
+  uint8_t heartbeat_response = 0xFF;
+  uint64_t probe_deadline = mems_deadline_ms(probe_ms);
+  bool live = false;
+
+  d0.reply = d0_response;
+
+  // a heartbeat, sent quietly since a cold ECU is expected to ignore it
+  if (mems_lock(info))
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_c);
-    return false;
+    live = mems_send_command_quiet(info, (uint8_t)MEMS_Heartbeat, probe_deadline) &&
+           (mems_read_serial_quiet(info, &heartbeat_response, 1, probe_deadline) == 1);
+    mems_unlock(info);
   }
-  if (mems_read_serial(info, &buffer, 1) != 1)
+
+  if (live && !info->d0_cached)
   {
-    dprintf_err("mems_init_link(): Did not see null terminator for %02X command\n", command_c);
-    return false;
+    live = (mems_transact(info, &d0, 1, mems_deadline_ms(probe_ms)) == 1);
+    if (live)
+    {
+      memcpy(info->d0_response, d0_response, sizeof(info->d0_response));
+      info->d0_cached = true;
+    }
   }
-  if (!mems_send_command(info, command_d))
+
+  if (resumed)
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_d);
-    return false;
+    *resumed = live;
   }
 
-  // Expect four more bytes after the echo of the D0 command byte.
-  // Response is 99 00 03 03 for Mini SPi.
-  if (mems_read_serial(info, d0_response_buffer, 4) != 4)
+  if (!live)
   {
-    dprintf_err("mems_init_link(): Received fewer bytes than expected after echo of %02X command", command_d);
-    return false;
+    // don't let anything received in answer to the probe be mistaken for
+    // part of the handshake
+    if (mems_lock(info))
+    {
+      info->transport->flush(info);
+      mems_unlock(info);
+    }
+
+    return mems_init_link(info, d0_response_buffer);
   }
 
+  memcpy(d0_response_buffer, info->d0_response, sizeof(info->d0_response));
+
   return true;
 }
 
+/**
+ * Sets the D0 reply that mems_init_link_fast() reports when it resumes a
+ * session, e.g. one saved by a previous run of the program.
+ * @param info State information for the current connection.
+ * @param d0_response Four bytes of the D0 reply, or NULL to forget the
+ *   cached reply
+ */
+void mems_set_d0_response(mems_info *info, const uint8_t *d0_response)
+{
+  if (d0_response)
+  {
+    memcpy(info->d0_response, d0_response, sizeof(info->d0_response));
+  }
+
+  info->d0_cached = (d0_response != NULL);
+}
+
+/**
+ * Runs a list of commands on a connection whose mutex is already held.
+ * @return Number of commands (from the start of the list) that completed
+ */
+int mems_transact_locked(mems_info *info, mems_command *commands, size_t count, uint64_t deadline_us)
+{
+  uint8_t discard[UINT8_MAX + 1];
+  uint8_t *reply;
+  size_t idx;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    commands[idx].ok = false;
+  }
+
+  for (idx = 0; idx < count; idx++)
+  {
+    reply = commands[idx].reply ? commands[idx].reply : discard;
+
+    if (!mems_send_command_timed(info, commands[idx].command, deadline_us) ||
+        ((commands[idx].reply_len > 0) &&
+         (mems_read_serial_timed(info, reply, commands[idx].reply_len, deadline_us) != commands[idx].reply_len)))
+    {
+      break;
+    }
+
+    commands[idx].ok = true;
+  }
+
+  return (int)idx;
+}
+
+/**
+ * Runs a list of commands as one transaction: the connection mutex is taken
+ * once for the whole list, so other threads cannot interleave their own
+ * commands, and every command shares the same deadline. The list stops at
+ * the first command whose echo or reply does not arrive in full.
+ * @param info State information for the current connection.
+ * @param commands Commands to send, each with the length of its expected
+ *   reply and a buffer to receive it
+ * @param count Number of commands in the list
+ * @param deadline_us Absolute deadline for the whole list, or MEMS_NO_DEADLINE
+ * @return Number of commands (from the start of the list) that completed,
+ *   or -1 if the connection could not be locked
+ */
+int mems_transact(mems_info *info, mems_command *commands, size_t count, uint64_t deadline_us)
+{
+  int completed = -1;
+
+  if (mems_lock(info))
+  {
+    completed = mems_transact_locked(info, commands, count, deadline_us);
+    mems_unlock(info);
+  }
+
+  return completed;
+}
+
 /**
  * Locks the mutex used for threadsafe access
  */
@@ -216,43 +443,202 @@ void mems_unlock(mems_info *info)
  */
 bool mems_read_raw(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d)
 {
-  bool status = false;
+  return mems_read_raw_timed(info, frame80, frame7d, MEMS_NO_DEADLINE);
+}
 
-  if (mems_lock(info))
+/**
+ * Copies a frame completed by the parser into the caller's frame buffers.
+ * @return Flag (MEMS_Frame80_Ready or MEMS_Frame7D_Ready) for the frame copied
+ */
+static uint8_t mems_take_frame(mems_parser *parser, uint8_t command, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d)
+{
+  if (command == MEMS_ReqData80)
+  {
+    memcpy(frame80, &parser->frame.f80, sizeof(mems_data_frame_80));
+    return MEMS_Frame80_Ready;
+  }
+
+  if (command == MEMS_ReqData7D)
+  {
+    memcpy(frame7d, &parser->frame.f7d, sizeof(mems_data_frame_7d));
+    return MEMS_Frame7D_Ready;
+  }
+
+  return 0;
+}
+
+/**
+ * Sends the 0x7D request as soon as the echo of the 0x80 request has been
+ * seen, rather than waiting for the whole 0x80 frame, so that the ECU can
+ * start the second reply without an idle turnaround on the line. The
+ * combined reply is read in one call and split by the frame parser.
+ * @return Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready for the
+ *   frames that were received intact
+ */
+static uint8_t mems_read_raw_pipelined(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d, uint64_t deadline_us)
+{
+  uint8_t cmd80 = MEMS_ReqData80;
+  uint8_t cmd7d = MEMS_ReqData7D;
+  uint8_t buffer[1 + sizeof(mems_data_frame_80) + 1 + sizeof(mems_data_frame_7d)];
+  uint8_t ready = 0;
+  uint8_t command;
+  int16_t count;
+  size_t used = 0;
+  mems_parser parser;
+
+  mems_parser_init(&parser);
+
+  if ((mems_write_serial(info, &cmd80, 1) == 1) &&
+      (mems_read_serial_timed(info, buffer, 1, deadline_us) == 1))
   {
-    if (mems_send_command(info, MEMS_ReqData80))
+    mems_parser_feed(&parser, buffer, 1, &command);
+
+    if ((parser.state == MEMS_Parse_Length) && (parser.command == MEMS_ReqData80) &&
+        (mems_write_serial(info, &cmd7d, 1) == 1))
     {
-      if (mems_read_serial(info, (uint8_t *)(frame80), sizeof(mems_data_frame_80)) == sizeof(mems_data_frame_80))
+      count = mems_read_serial_timed(info, buffer, sizeof(buffer) - 1, deadline_us);
+
+      while ((count > 0) && (used < (size_t)count))
       {
-        status = true;
+        used += mems_parser_feed(&parser, buffer + used, count - used, &command);
+        ready |= mems_take_frame(&parser, command, frame80, frame7d);
       }
-      else
+    }
+  }
+  else
+  {
+    dprintf_err("mems_read_raw(): did not receive echo of pipelined command 80\n");
+  }
+
+  if (parser.resyncs)
+  {
+    dprintf_err("mems_read_raw(): discarded %u unexpected bytes in pipelined reply\n", parser.discarded);
+  }
+
+  return ready;
+}
+
+/**
+ * Enables or disables pipelining of the 0x7D request behind the 0x80 request
+ * in mems_read_raw(). If the ECU does not answer the early 0x7D request,
+ * the frame is completed in lock-step and pipelining is switched off again.
+ * @param info State information for the current connection.
+ * @param pipelined True to send the second request before the first reply is complete
+ */
+void mems_set_pipelined(mems_info *info, bool pipelined)
+{
+  if (mems_lock(info))
+  {
+    info->pipelined = pipelined;
+    mems_unlock(info);
+  }
+}
+
+/**
+ * Requests one data frame from the ECU and reads it, with the connection
+ * already locked by the caller. If the echo or frame is wrong or short, the
+ * link is resynchronised and the frame requested again, up to
+ * info->max_retries times or until the deadline passes. If the read
+ * fails, the input is drained before returning.
+ * @param cmd Data request command (MEMS_ReqData80 or MEMS_ReqData7D)
+ * @param frame Receives the frame
+ * @param size Expected size of the frame
+ * @return True if the whole frame arrived by the deadline
+ */
+bool mems_read_frame_locked(mems_info *info, uint8_t cmd, uint8_t *frame, uint16_t size, uint64_t deadline_us)
+{
+  unsigned int attempt;
+
+  for (attempt = 0; attempt <= info->max_retries; attempt++)
+  {
+    // after a failure, leftover bytes would corrupt the next reply
+    if (attempt > 0)
+    {
+      if (((deadline_us != MEMS_NO_DEADLINE) && (mems_monotonic_us() >= deadline_us)) ||
+          !mems_resync_locked(info, deadline_us))
       {
-        dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x80\n");
+        break;
       }
+      info->link_stats.retries += 1;
+    }
+
+    if (!mems_send_command_timed(info, cmd, deadline_us))
+    {
+      dprintf_err("mems_read_raw(): failed to send read command 0x%02X\n", cmd);
+    }
+    else if (mems_read_serial_timed(info, frame, size, deadline_us) != size)
+    {
+      dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x%02X\n", cmd);
     }
     else
     {
-      dprintf_err("mems_read_raw(): failed to send read command 0x80\n");
+      if (attempt > 0)
+      {
+        info->link_stats.recovered += 1;
+      }
+      return true;
     }
+  }
 
-    if (status)
+  // whether or not a retry was made, the rest of the bad reply must not be
+  // read as the echo of the next command
+  mems_drain_locked(info, deadline_us);
+  info->link_stats.failures += 1;
+
+  return false;
+}
+
+/**
+ * Reads both raw data frames from the ECU, failing if they have not both
+ * arrived by the deadline.
+ */
+bool mems_read_raw_timed(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d, uint64_t deadline_us)
+{
+  bool status = false;
+  uint8_t ready = 0;
+
+  if (mems_lock(info))
+  {
+    if (info->pipelined)
     {
-      if (mems_send_command(info, MEMS_ReqData7D))
+      ready = mems_read_raw_pipelined(info, frame80, frame7d, deadline_us);
+
+      if (ready == (MEMS_Frame80_Ready | MEMS_Frame7D_Ready))
       {
-        if (mems_read_serial(info, (uint8_t *)(frame7d), sizeof(mems_data_frame_7d)) != sizeof(mems_data_frame_7d))
-        {
-          dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x7D\n");
-          status = false;
-        }
+        mems_unlock(info);
+        return true;
+      }
+
+      if (ready == MEMS_Frame80_Ready)
+      {
+        // the 0x80 frame arrived but the early 0x7D request was ignored;
+        // finish this frame in lock-step and stop pipelining
+        dprintf_err("mems_read_raw(): ECU did not answer pipelined 0x7D request, reverting to lock-step\n");
+        info->pipelined = false;
       }
       else
       {
-        dprintf_err("mems_read_raw(): failed to send read command 0x7D\n");
-        status = false;
+        // retry both frames in lock-step, keeping pipelining for later reads
+        dprintf_err("mems_read_raw(): failed to read pipelined data frames\n");
+        ready = 0;
+        if (!mems_resync_locked(info, deadline_us))
+        {
+          info->link_stats.failures += 1;
+          mems_unlock(info);
+          return false;
+        }
+        info->link_stats.retries += 1;
       }
     }
 
+    status = (ready & MEMS_Frame80_Ready) ||
+             mems_read_frame_locked(info, MEMS_ReqData80, (uint8_t *)frame80, sizeof(mems_data_frame_80), deadline_us);
+
+    if (status)
+    {
+      status = mems_read_frame_locked(info, MEMS_ReqData7D, (uint8_t *)frame7d, sizeof(mems_data_frame_7d), deadline_us);
+    }
+
     mems_unlock(info);
   }
 
@@ -264,104 +650,426 @@ bool mems_read_raw(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame
  */
 bool mems_read(mems_info *info, mems_data *data)
 {
-  bool success = false;
-  static mems_data_frame_80 dframe80;
-  static mems_data_frame_7d dframe7d;
-  char *raw7d;
-  char *raw80;
-
-  if (mems_read_raw(info, &dframe80, &dframe7d))
-  {
-    memset(data, 0, sizeof(mems_data));
-
-    // dataframe 0x80
-    data->engine_rpm = ((uint16_t)dframe80.engine_rpm_hi << 8) | dframe80.engine_rpm_lo;
-    data->coolant_temp_c = dframe80.coolant_temp - 55;
-    data->ambient_temp_c = dframe80.ambient_temp - 55;
-    data->intake_air_temp_c = dframe80.intake_air_temp - 55;
-    data->fuel_temp_c = dframe80.fuel_temp - 55;
-    data->map_kpa = dframe80.map_kpa;
-    data->battery_voltage = dframe80.battery_voltage / 10.0;
-    data->throttle_pot_voltage = dframe80.throttle_pot * 0.02;
-    data->idle_switch = (dframe80.idle_switch == 0) ? 0 : 1;
-    data->uk1 = dframe80.uk1;
-    data->park_neutral_switch = (dframe80.park_neutral_switch == 0) ? 0 : 1;
-    data->fault_codes = 0;
-    data->idle_set_point = dframe80.idle_set_point;
-    data->idle_hot = dframe80.idle_hot;
-    data->uk2 = dframe80.uk2;
-    data->iac_position = dframe80.iac_position;
-    data->idle_error = ((uint16_t)dframe80.idle_error_hi << 8) | dframe80.idle_error_lo;
-    data->ignition_advance_offset = dframe80.ignition_advance_offset;
-    data->ignition_advance = (dframe80.ignition_advance * 0.5) - 24.0;
-    data->coil_time = (((uint16_t)dframe80.coil_time_hi << 8) | dframe80.coil_time_lo) * 0.002;
-    data->crankshaft_position_sensor = dframe80.crankshaft_position_sensor;
-    data->uk4 = dframe80.uk4;
-    data->uk5 = dframe80.uk5;
-
-    // update fault codes
-    if (dframe80.dtc0 & 0x01)
-    { // coolant temp sensor fault
-      data->fault_codes |= (1 << 0);
-      data->coolant_temp_sensor_fault = true;
+  return mems_read_timed(info, data, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads and parses both data frames, failing if they have not both arrived
+ * by the deadline.
+ */
+bool mems_read_timed(mems_info *info, mems_data *data, uint64_t deadline_us)
+{
+  mems_compact_sample sample;
+
+  if (!mems_read_compact_timed(info, &sample, deadline_us))
+  {
+    return false;
+  }
+
+  mems_decode(&sample.frame80, &sample.frame7d, data);
+
+  return true;
+}
+
+/**
+ * Reads both data frames into a compact sample without decoding them.
+ * @param info State information for the current connection.
+ * @param sample Receives the frames and the time the read was started
+ * @return True if both frames were read
+ */
+bool mems_read_compact(mems_info *info, mems_compact_sample *sample)
+{
+  return mems_read_compact_timed(info, sample, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads both data frames into a compact sample, failing if they have not
+ * both arrived by the deadline.
+ */
+bool mems_read_compact_timed(mems_info *info, mems_compact_sample *sample, uint64_t deadline_us)
+{
+  sample->timestamp_us = mems_monotonic_us();
+  sample->frames = 0;
+
+  if (!mems_read_raw_timed(info, &sample->frame80, &sample->frame7d, deadline_us))
+  {
+    return false;
+  }
+
+  sample->frames = MEMS_Frame80_Ready | MEMS_Frame7D_Ready;
+  mems_publish_latest(info, sample);
+
+  return true;
+}
+
+/**
+ * Reads both data frames for decoding on demand (see mems_lazy_data).
+ * Unlike mems_read(), nothing is decoded or hex-encoded until a field is
+ * asked for.
+ * @param info State information for the current connection.
+ * @param lazy Receives the frames; any fields kept from an earlier sample
+ *   are discarded
+ * @return True if both frames were read
+ */
+bool mems_read_lazy(mems_info *info, mems_lazy_data *lazy)
+{
+  return mems_read_lazy_timed(info, lazy, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads both data frames for decoding on demand, failing if they have not
+ * both arrived by the deadline.
+ */
+bool mems_read_lazy_timed(mems_info *info, mems_lazy_data *lazy, uint64_t deadline_us)
+{
+  lazy->valid = 0;
+
+  if (!mems_read_compact_timed(info, &lazy->sample, deadline_us))
+  {
+    return false;
+  }
+
+  lazy->data.frames = lazy->sample.frames;
+
+  return true;
+}
+
+/**
+ * Stores a newly read sample in the latest-sample cell. The cell is a
+ * seqlock: the sequence is made odd while the sample is copied in and even
+ * again afterwards, so readers never need to take the connection mutex.
+ * Concurrent writers serialise on the transition from even to odd.
+ */
+void mems_publish_latest(mems_info *info, const mems_compact_sample *sample)
+{
+  uint32_t seq = __atomic_load_n(&info->latest_seq, __ATOMIC_RELAXED);
+
+  do
+  {
+    while (seq & 1)
+    {
+      seq = __atomic_load_n(&info->latest_seq, __ATOMIC_RELAXED);
     }
+  } while (!__atomic_compare_exchange_n(&info->latest_seq, &seq, seq + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(&info->latest, sample, sizeof(mems_compact_sample));
+
+  __atomic_store_n(&info->latest_seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-    if (dframe80.dtc0 & 0x02)
-    { // intake air temp sensor fault
-      data->fault_codes |= (1 << 1);
-      data->intake_air_temp_sensor_fault = true;
+/**
+ * Copies the most recent sample read on this connection by mems_read(),
+ * a stream or an acquisition engine, without taking the connection mutex
+ * or touching the serial port. Safe to call from any number of threads.
+ * @param info State information for the current connection.
+ * @param sample Receives a consistent copy of the latest sample
+ * @return True if a sample has been read since mems_init()
+ */
+bool mems_get_latest(mems_info *info, mems_sample *sample)
+{
+  mems_compact_sample latest;
+  uint32_t before;
+  uint32_t after;
+
+  for (;;)
+  {
+    before = __atomic_load_n(&info->latest_seq, __ATOMIC_ACQUIRE);
+    if (before & 1)
+    {
+      continue;
     }
 
-    if (dframe80.dtc1 & 0x02)
-    { // fuel pump circuit fault
-      data->fault_codes |= (1 << 2);
-      data->fuel_pump_circuit_fault = true;
+    memcpy(&latest, &info->latest, sizeof(mems_compact_sample));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    after = __atomic_load_n(&info->latest_seq, __ATOMIC_RELAXED);
+    if (before == after)
+    {
+      break;
     }
+  }
+
+  // decode outside the loop so that a writer never waits on the decoding
+  mems_decode_compact(&latest, sample);
+
+  return (before != 0);
+}
+
+/**
+ * Converts a raw 0x80 data frame into engineering units, as described by
+ * MEMS_DATA_VALUES.
+ */
+void mems_decode_80(const mems_data_frame_80 *frame80, mems_data *data)
+{
+#define MEMS_DECODE_80(member, type, frame, offset, kind, scale, bias, name)                     \
+  if (frame == MEMS_Frame80_Ready)                                                               \
+  {                                                                                              \
+    data->member = (type)mems_decode_field((const uint8_t *)frame80, offset, kind, scale, bias); \
+  }
+
+  MEMS_DATA_VALUES(MEMS_DECODE_80)
+
+#undef MEMS_DECODE_80
+
+  convert_dataframe_to_string(data->raw80, frame80, sizeof(mems_data_frame_80));
+  data->frames |= MEMS_Frame80_Ready;
+}
+
+/**
+ * Converts a raw 0x7D data frame into engineering units, as described by
+ * MEMS_DATA_VALUES.
+ */
+void mems_decode_7d(const mems_data_frame_7d *frame7d, mems_data *data)
+{
+#define MEMS_DECODE_7D(member, type, frame, offset, kind, scale, bias, name)                     \
+  if (frame == MEMS_Frame7D_Ready)                                                               \
+  {                                                                                              \
+    data->member = (type)mems_decode_field((const uint8_t *)frame7d, offset, kind, scale, bias); \
+  }
+
+  MEMS_DATA_VALUES(MEMS_DECODE_7D)
+
+#undef MEMS_DECODE_7D
+
+  convert_dataframe_to_string(data->raw7d, frame7d, sizeof(mems_data_frame_7d));
+  data->frames |= MEMS_Frame7D_Ready;
+}
+
+/**
+ * Converts a pair of raw data frames into engineering units.
+ * @param frame80 Frame received in reply to command 0x80
+ * @param frame7d Frame received in reply to command 0x7D
+ * @param data Decoded values
+ */
+void mems_decode(const mems_data_frame_80 *frame80, const mems_data_frame_7d *frame7d, mems_data *data)
+{
+  memset(data, 0, sizeof(mems_data));
+
+  mems_decode_80(frame80, data);
+  mems_decode_7d(frame7d, data);
+}
+
+/**
+ * Decodes a compact sample. Fields from frames that were not received are
+ * zeroed and left out of sample->data.frames.
+ * @param compact Raw frames and timestamp
+ * @param sample Receives the decoded values and the same timestamp
+ */
+void mems_decode_compact(const mems_compact_sample *compact, mems_sample *sample)
+{
+  memset(&sample->data, 0, sizeof(mems_data));
+  sample->timestamp_us = compact->timestamp_us;
+
+  if (compact->frames & MEMS_Frame80_Ready)
+  {
+    mems_decode_80(&compact->frame80, &sample->data);
+  }
+
+  if (compact->frames & MEMS_Frame7D_Ready)
+  {
+    mems_decode_7d(&compact->frame7d, &sample->data);
+  }
+}
+
+/**
+ * Prepares a compact sample (e.g. one taken from a log) for decoding on
+ * demand. Fields from frames that were not received read as zero.
+ * @param lazy Receives the sample
+ * @param sample Raw frames and timestamp
+ */
+void mems_lazy_init(mems_lazy_data *lazy, const mems_compact_sample *sample)
+{
+  memcpy(&lazy->sample, sample, sizeof(mems_compact_sample));
+  lazy->valid = 0;
+
+  // the rare partial sample pays for clearing everything once
+  if (sample->frames != (MEMS_Frame80_Ready | MEMS_Frame7D_Ready))
+  {
+    memset(&lazy->data, 0, sizeof(mems_data));
+    lazy->valid = mems_frames_fields(~sample->frames & (MEMS_Frame80_Ready | MEMS_Frame7D_Ready));
+  }
+
+  lazy->data.frames = sample->frames;
+}
 
-    if (dframe80.dtc1 & 0x80)
-    { // throttle pot circuit fault
-      data->fault_codes |= (1 << 3);
-      data->throttle_pot_circuit_fault = true;
+/**
+ * Returns the 0x80 frame of a lazily decoded sample as a hex string,
+ * encoding it on first use.
+ * @param lazy Sample read with mems_read_lazy()
+ * @return The string, kept in lazy->data.raw80
+ */
+const char *mems_lazy_raw80(mems_lazy_data *lazy)
+{
+  if (!(lazy->valid & MEMS_FIELD(raw80)))
+  {
+    convert_dataframe_to_string(lazy->data.raw80, &lazy->sample.frame80, sizeof(mems_data_frame_80));
+    lazy->valid |= MEMS_FIELD(raw80);
+  }
+
+  return lazy->data.raw80;
+}
+
+/**
+ * Returns the 0x7D frame of a lazily decoded sample as a hex string,
+ * encoding it on first use.
+ * @param lazy Sample read with mems_read_lazy()
+ * @return The string, kept in lazy->data.raw7d
+ */
+const char *mems_lazy_raw7d(mems_lazy_data *lazy)
+{
+  if (!(lazy->valid & MEMS_FIELD(raw7d)))
+  {
+    convert_dataframe_to_string(lazy->data.raw7d, &lazy->sample.frame7d, sizeof(mems_data_frame_7d));
+    lazy->valid |= MEMS_FIELD(raw7d);
+  }
+
+  return lazy->data.raw7d;
+}
+
+/**
+ * Decodes a set of fields of a lazily decoded sample that have not been
+ * decoded yet, e.g. before passing the sample to mems_format_csv().
+ * @param lazy Sample read with mems_read_lazy()
+ * @param fields Mask of MEMS_FIELD() bits
+ * @return The decoded values; only the fields in lazy->valid are filled in
+ */
+const mems_data *mems_lazy_decode(mems_lazy_data *lazy, uint64_t fields)
+{
+  uint64_t missing = fields & ~lazy->valid;
+
+#define MEMS_LAZY_DECODE(member, type, frame, offset, kind, scale, bias, name) \
+  if (missing & MEMS_FIELD(member))                                            \
+  {                                                                            \
+    mems_lazy_##member(lazy);                                                  \
+  }
+
+  MEMS_DATA_VALUES(MEMS_LAZY_DECODE)
+
+#undef MEMS_LAZY_DECODE
+
+  if (missing & MEMS_FIELD(raw80))
+  {
+    mems_lazy_raw80(lazy);
+  }
+
+  if (missing & MEMS_FIELD(raw7d))
+  {
+    mems_lazy_raw7d(lazy);
+  }
+
+  return &lazy->data;
+}
+
+#define MEMS_FIELD_FRAME(member, type, frame, offset, kind, scale, bias, name) frame,
+
+//! Data frame that each field is decoded from, indexed by mems_field
+static const uint8_t mems_field_frame[MEMS_Field_Count] = {MEMS_DATA_FIELDS(MEMS_FIELD_FRAME)};
+
+#undef MEMS_FIELD_FRAME
+
+/**
+ * Works out which data frames are needed to decode a set of fields.
+ * @param fields Mask of MEMS_FIELD() bits
+ * @return Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready
+ */
+uint8_t mems_fields_frames(uint64_t fields)
+{
+  uint8_t frames = 0;
+  int idx;
+
+  for (idx = 0; idx < MEMS_Field_Count; idx++)
+  {
+    if (fields & ((uint64_t)1 << idx))
+    {
+      frames |= mems_field_frame[idx];
     }
+  }
 
-    // dataframe 0x7d
-
-    data->ignition_switch = dframe7d.ignition_switch;
-    data->throttle_angle = dframe7d.throttle_angle;
-    data->uk6 = dframe7d.uk6;
-    data->air_fuel_ratio = dframe7d.air_fuel_ratio;
-    data->dtc2 = dframe7d.dtc2;
-    data->lambda_voltage_mv = dframe7d.lambda_voltage * 5;
-    data->lambda_sensor_frequency = dframe7d.lambda_sensor_frequency;
-    data->lambda_sensor_dutycycle = dframe7d.lambda_sensor_dutycycle;
-    data->lambda_sensor_status = dframe7d.lambda_sensor_status;
-    data->closed_loop = dframe7d.closed_loop;
-    data->long_term_fuel_trim = dframe7d.long_term_fuel_trim;
-    data->short_term_fuel_trim = dframe7d.short_term_fuel_trim;
-    data->carbon_canister_dutycycle = dframe7d.carbon_canister_dutycycle;
-    data->dtc3 = dframe7d.dtc3;
-    data->idle_base_pos = dframe7d.idle_base_pos;
-    data->uk7 = dframe7d.uk7;
-    data->dtc4 = dframe7d.dtc4;
-    data->ignition_advance2 = dframe7d.ignition_advance2;
-    data->idle_speed_offset = dframe7d.idle_speed_offset;
-    data->idle_error2 = dframe7d.idle_error2;
-    data->uk10 = dframe7d.uk10;
-    data->dtc5 = dframe7d.dtc5;
-    data->uk11 = dframe7d.uk11;
-    data->uk12 = dframe7d.uk12;
-    data->uk13 = dframe7d.uk13;
-    data->uk14 = dframe7d.uk14;
-    data->uk15 = dframe7d.uk15;
-    data->uk16 = dframe7d.uk16;
-    data->uk1A = dframe7d.uk17;
-    data->uk1B = dframe7d.uk18;
-    data->uk1C = dframe7d.uk19;
-
-    convert_dataframe_to_string(data->raw80, &dframe80, sizeof(mems_data_frame_80));
-    convert_dataframe_to_string(data->raw7d, &dframe7d, sizeof(mems_data_frame_7d));
-
-    success = true;
+  return frames;
+}
+
+/**
+ * Lists the fields that are decoded from a set of data frames, e.g. to
+ * find which fields of a mems_data are current: mems_frames_fields(data->frames).
+ * @param frames Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready
+ * @return Mask of MEMS_FIELD() bits
+ */
+uint64_t mems_frames_fields(uint8_t frames)
+{
+  uint64_t fields = 0;
+  int idx;
+
+  for (idx = 0; idx < MEMS_Field_Count; idx++)
+  {
+    if (frames & mems_field_frame[idx])
+    {
+      fields |= ((uint64_t)1 << idx);
+    }
+  }
+
+  return fields;
+}
+
+/**
+ * Reads only the data frames needed for the requested fields.
+ */
+bool mems_read_fields(mems_info *info, mems_data *data, uint64_t fields)
+{
+  return mems_read_fields_timed(info, data, fields, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads only the data frames needed for the requested fields, failing if
+ * they have not arrived by the deadline. Fields from a frame that was not
+ * requested are zeroed and left out of data->frames. When both frames are
+ * needed this is the same as mems_read_timed().
+ * @param info State information for the current connection.
+ * @param data Receives the decoded values
+ * @param fields Mask of MEMS_FIELD() bits, e.g.
+ *   MEMS_FIELD(lambda_voltage_mv) | MEMS_FIELD(short_term_fuel_trim)
+ * @param deadline_us Absolute deadline, or MEMS_NO_DEADLINE
+ * @return True if the needed frames were read
+ */
+bool mems_read_fields_timed(mems_info *info, mems_data *data, uint64_t fields, uint64_t deadline_us)
+{
+  bool success = false;
+  uint8_t frames = mems_fields_frames(fields);
+  mems_data_frame_80 dframe80;
+  mems_data_frame_7d dframe7d;
+
+  if (frames == (MEMS_Frame80_Ready | MEMS_Frame7D_Ready))
+  {
+    return mems_read_timed(info, data, deadline_us);
+  }
+
+  memset(data, 0, sizeof(mems_data));
+
+  if ((frames != 0) && mems_lock(info))
+  {
+    if (frames == MEMS_Frame80_Ready)
+    {
+      success = mems_read_frame_locked(info, MEMS_ReqData80, (uint8_t *)&dframe80, sizeof(mems_data_frame_80), deadline_us);
+    }
+    else
+    {
+      success = mems_read_frame_locked(info, MEMS_ReqData7D, (uint8_t *)&dframe7d, sizeof(mems_data_frame_7d), deadline_us);
+    }
+
+    mems_unlock(info);
+  }
+
+  if (success)
+  {
+    if (frames == MEMS_Frame80_Ready)
+    {
+      mems_decode_80(&dframe80, data);
+    }
+    else
+    {
+      mems_decode_7d(&dframe7d, data);
+    }
   }
 
   return success;
@@ -371,13 +1079,22 @@ bool mems_read(mems_info *info, mems_data *data)
  * Reads the current idle air control motor position.
  */
 bool mems_read_iac_position(mems_info *info, uint8_t *position)
+{
+  return mems_read_iac_position_timed(info, position, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Reads the current idle air control motor position, failing if the reply
+ * has not arrived by the deadline.
+ */
+bool mems_read_iac_position_timed(mems_info *info, uint8_t *position, uint64_t deadline_us)
 {
   bool status = false;
 
   if (mems_lock(info))
   {
-    status = mems_send_command(info, MEMS_GetIACPosition) &&
-             (mems_read_serial(info, position, 1) == 1);
+    status = mems_send_command_timed(info, MEMS_GetIACPosition, deadline_us) &&
+             (mems_read_serial_timed(info, position, 1, deadline_us) == 1);
     mems_unlock(info);
   }
   return status;
@@ -387,49 +1104,33 @@ bool mems_read_iac_position(mems_info *info, uint8_t *position)
  * Repeatedly send command to open or close the idle air control valve until
  * it is in the desired position. The valve does not necessarily move one full
  * step per serial command, depending on the rate at which the commands are
- * issued.
+ * issued. See mems_iac_move() for the details of each step.
  */
 bool mems_move_iac(mems_info *info, uint8_t desired_pos)
 {
-  bool status = false;
-  uint16_t attempts = 0;
-  uint8_t current_pos = 0;
-  actuator_cmd cmd;
-
-  // read the current IAC position, and only take action
-  // if we're not already at the desired point
-  if (mems_read_iac_position(info, &current_pos))
-  {
-    if ((desired_pos < current_pos) ||
-        ((desired_pos > current_pos) && (current_pos < IAC_MAXIMUM)))
-    {
-      cmd = (desired_pos > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
-
-      do
-      {
-        status = mems_test_actuator(info, cmd, &current_pos);
-        attempts += 1;
-      } while (status && (current_pos != desired_pos) && (attempts < 300));
-    }
-  }
-
-  status = (desired_pos == current_pos);
-
-  return status;
+  return mems_iac_move(info, desired_pos, 0, MEMS_NO_DEADLINE, NULL);
 }
 
 /**
  * Sends a command to run an actuator test, and returns the single byte of data.
  */
 bool mems_test_actuator(mems_info *info, actuator_cmd cmd, uint8_t *data)
+{
+  return mems_test_actuator_timed(info, cmd, data, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Runs an actuator test, failing if the reply has not arrived by the deadline.
+ */
+bool mems_test_actuator_timed(mems_info *info, actuator_cmd cmd, uint8_t *data, uint64_t deadline_us)
 {
   bool status = false;
   uint8_t response = 0x00;
 
   if (mems_lock(info))
   {
-    if (mems_send_command(info, cmd) &&
-        (mems_read_serial(info, &response, 1) == 1))
+    if (mems_send_command_timed(info, cmd, deadline_us) &&
+        (mems_read_serial_timed(info, &response, 1, deadline_us) == 1))
     {
       if (data)
       {
@@ -469,6 +1170,14 @@ bool mems_clear_faults(mems_info *info)
  * Sends a simple heartbeat (ping) command to check connectivity
  */
 bool mems_heartbeat(mems_info *info)
+{
+  return mems_heartbeat_timed(info, MEMS_NO_DEADLINE);
+}
+
+/**
+ * Sends a heartbeat command, failing if the reply has not arrived by the deadline.
+ */
+bool mems_heartbeat_timed(mems_info *info, uint64_t deadline_us)
 {
   bool status = false;
   uint8_t response = 0xFF;
@@ -477,8 +1186,8 @@ bool mems_heartbeat(mems_info *info)
   {
     // send the command and check for one additional byte after the
     // echoed command byte (should be 0x00)
-    if (mems_send_command(info, (uint8_t)MEMS_Heartbeat) &&
-        (mems_read_serial(info, &response, 1) == 1))
+    if (mems_send_command_timed(info, (uint8_t)MEMS_Heartbeat, deadline_us) &&
+        (mems_read_serial_timed(info, &response, 1, deadline_us) == 1))
     {
       status = true;
     }
@@ -99,7 +99,9 @@ enum command_idx
   MC_Coil = 8,
   MC_Injectors = 9,
   MC_Interactive = 10,
-  MC_Num_Commands = 11
+  MC_Burst = 11,
+  MC_Calibrate = 12,
+  MC_Num_Commands = 13
 };
 
 static const char *commands[] = {
@@ -113,18 +115,29 @@ static const char *commands[] = {
     "ac",
     "coil",
     "injectors",
-    "interactive"};
-
+    "interactive",
+    "burst",
+    "calibrate"};
+
+/**
+ * Formats the time of day for the log. The text only changes once a
+ * second, so it is rebuilt only when the second changes rather than for
+ * every sample.
+ */
 char *simple_current_time(void)
 {
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  struct timeval tv;
   static char buffer[50];
+  static time_t cached = (time_t)-1;
+  time_t t = time(NULL);
+  struct tm tm;
 
-  gettimeofday(&tv, NULL);
+  if (t != cached)
+  {
+    tm = *localtime(&t);
+    sprintf(buffer, "%02d:%02d:%02d.000", tm.tm_hour, tm.tm_min, tm.tm_sec);
+    cached = t;
+  }
 
-  sprintf(buffer, "%02d:%02d:%02d.000", tm.tm_hour, tm.tm_min, tm.tm_sec);
   return buffer;
 }
 
@@ -162,6 +175,21 @@ int read_config(readmems_config *config, char *path)
   config->output = strdup("stdout");
   config->loop = strdup("inf");
   config->connection = strdup("nowait");
+  config->io = strdup("blocking");
+  config->pipelined = strdup("no");
+  config->rate = strdup("2");
+  config->burst_frame = strdup("7d");
+  config->burst_seconds = strdup("10");
+  config->low_latency = strdup("no");
+  config->reconnect = strdup("yes");
+  config->fast_connect = strdup("yes");
+  config->d0cache = strdup("");
+  config->adaptive = strdup("no");
+  config->rate_steady = strdup("0.5");
+  config->rate_stopped = strdup("0.2");
+  config->rpm_threshold = strdup("50");
+  config->throttle_threshold = strdup("2");
+  config->steady_samples = strdup("10");
 
   if (file)
   {
@@ -210,6 +238,81 @@ int read_config(readmems_config *config, char *path)
           {
             config->connection = strdup(value);
           }
+
+          if (strcasecmp(key, "io") == 0)
+          {
+            config->io = strdup(value);
+          }
+
+          if (strcasecmp(key, "pipelined") == 0)
+          {
+            config->pipelined = strdup(value);
+          }
+
+          if (strcasecmp(key, "rate") == 0)
+          {
+            config->rate = strdup(value);
+          }
+
+          if (strcasecmp(key, "burst_frame") == 0)
+          {
+            config->burst_frame = strdup(value);
+          }
+
+          if (strcasecmp(key, "burst_seconds") == 0)
+          {
+            config->burst_seconds = strdup(value);
+          }
+
+          if (strcasecmp(key, "low_latency") == 0)
+          {
+            config->low_latency = strdup(value);
+          }
+
+          if (strcasecmp(key, "fast_connect") == 0)
+          {
+            config->fast_connect = strdup(value);
+          }
+
+          if (strcasecmp(key, "d0cache") == 0)
+          {
+            config->d0cache = strdup(value);
+          }
+
+          if (strcasecmp(key, "reconnect") == 0)
+          {
+            config->reconnect = strdup(value);
+          }
+
+          if (strcasecmp(key, "adaptive") == 0)
+          {
+            config->adaptive = strdup(value);
+          }
+
+          if (strcasecmp(key, "rate_steady") == 0)
+          {
+            config->rate_steady = strdup(value);
+          }
+
+          if (strcasecmp(key, "rate_stopped") == 0)
+          {
+            config->rate_stopped = strdup(value);
+          }
+
+          if (strcasecmp(key, "rpm_threshold") == 0)
+          {
+            config->rpm_threshold = strdup(value);
+          }
+
+          if (strcasecmp(key, "throttle_threshold") == 0)
+          {
+            config->throttle_threshold = strdup(value);
+          }
+
+          if (strcasecmp(key, "steady_samples") == 0)
+          {
+            config->steady_samples = strdup(value);
+          }
         }
       }
     }
@@ -315,16 +418,15 @@ int get_file_size(FILE *fp)
 
 char *write_memsscan_header(FILE *fp)
 {
-  static char header[1024];
+  static char header[2048];
+  size_t len;
 
-  // create header
-  sprintf(header, "#time,"
-                  "80x01-02_engine-rpm,80x03_coolant_temp,80x04_ambient_temp,80x05_intake_air_temp,80x06_fuel_temp,80x07_map_kpa,80x08_battery_voltage,80x09_throttle_pot,80x0A_idle_switch,80x0B_uk1,"
-                  "80x0C_park_neutral_switch,80x0D-0E_fault_codes,80x0F_idle_set_point,80x10_idle_hot,80x11_uk2,80x12_iac_position,80x13-14_idle_error,80x15_ignition_advance_offset,80x16_ignition_advance,80x17-18_coil_time,"
-                  "80x19_crankshaft_position_sensor,80x1A_uk4,80x1B_uk5,"
-                  "7dx01_ignition_switch,7dx02_throttle_angle,7dx03_uk6,7dx04_air_fuel_ratio,7dx05_dtc2,7dx06_lambda_voltage,7dx07_lambda_sensor_frequency,7dx08_lambda_sensor_dutycycle,7dx09_lambda_sensor_status,7dx0A_closed_loop,"
-                  "7dx0B_long_term_fuel_trim,7dx0C_short_term_fuel_trim,7dx0D_carbon_canister_dutycycle,7dx0E_dtc3,7dx0F_idle_base_pos,7dx10_uk7,7dx11_dtc4,7dx12_ignition_advance2,7dx13_idle_speed_offset,7dx14_idle_error2,"
-                  "7dx14-15_uk10,7dx16_dtc5,7dx17_uk11,7dx18_uk12,7dx19_uk13,7dx1A_uk14,7dx1B_uk15,7dx1C_uk16,7dx1D_uk17,7dx1E_uk18,7dx1F_uk19,0x7d_raw,0x80_raw\n");
+  // create header; the columns are generated from the field table
+  len = sprintf(header, "#time,");
+  len += mems_format_csv_header(MEMS_CSV_FIELDS, header + len, sizeof(header) - len - 1);
+  if (len > sizeof(header) - 2)
+    len = sizeof(header) - 2;
+  strcpy(header + len, "\n");
 
   printf("%s", header);
 
@@ -340,6 +442,108 @@ void delete_file(char *filename)
   remove(filename);
 }
 
+/**
+ * Reports the outcome of an idle air control move on stdout and syslog.
+ */
+void report_iac_move(mems_iac_result *result)
+{
+  printf("IAC moved from 0x%02X to 0x%02X in %u steps (%u ms)%s\n",
+         result->start_position, result->final_position, result->steps,
+         (unsigned int)(result->elapsed_us / 1000), result->stalled ? ", stalled" : "");
+  syslog(LOG_NOTICE, "IAC moved from 0x%02X to 0x%02X in %u steps (%u ms)%s",
+         result->start_position, result->final_position, result->steps,
+         (unsigned int)(result->elapsed_us / 1000), result->stalled ? ", stalled" : "");
+}
+
+/**
+ * Reads the ECU's reply to the D0 command saved by a previous run, so that
+ * an ECU session that is still live can be resumed without the handshake.
+ * @return True if the file held a reply
+ */
+bool load_d0_cache(const char *path, uint8_t *d0_response)
+{
+  FILE *file;
+  unsigned int bytes[4];
+  bool result = false;
+  int idx;
+
+  if ((path[0] != 0) && ((file = fopen(path, "r")) != NULL))
+  {
+    if (fscanf(file, "%x %x %x %x", &bytes[0], &bytes[1], &bytes[2], &bytes[3]) == 4)
+    {
+      for (idx = 0; idx < 4; idx++)
+      {
+        d0_response[idx] = (uint8_t)bytes[idx];
+      }
+      result = true;
+    }
+    fclose(file);
+  }
+
+  return result;
+}
+
+/**
+ * Saves the ECU's reply to the D0 command for the next run.
+ */
+void save_d0_cache(const char *path, const uint8_t *d0_response)
+{
+  FILE *file;
+
+  if ((path[0] != 0) && ((file = fopen(path, "w")) != NULL))
+  {
+    fprintf(file, "%02X %02X %02X %02X\n", d0_response[0], d0_response[1], d0_response[2], d0_response[3]);
+    fclose(file);
+  }
+}
+
+/**
+ * Reports the link to the ECU being lost or restored, on stdout and syslog.
+ * Called by the supervisor, possibly from the acquisition thread.
+ */
+void report_link_change(void *context, bool up)
+{
+  (void)context;
+
+  if (up)
+  {
+    printf("reconnected to ECU\n");
+    syslog(LOG_NOTICE, "reconnected to ECU");
+    led_flash(3, 50);
+  }
+  else
+  {
+    printf("lost connection to ECU, reconnecting\n");
+    syslog(LOG_WARNING, "lost connection to ECU, reconnecting");
+  }
+}
+
+/**
+ * Formats a decoded sample as a line of the mems-scan CSV log and writes it
+ * to stdout, syslog and the log file (if one is open).
+ */
+void log_memsscan_line(FILE **fp, mems_data *data)
+{
+  char log_line[2048];
+  size_t len;
+
+  // the values are formatted without printf(), which dominates the CPU
+  // time of logging on small boards
+  len = strlen(strcpy(log_line, simple_current_time()));
+  log_line[len++] = ',';
+  len += mems_format_csv(data, MEMS_CSV_FIELDS, log_line + len, sizeof(log_line) - len - 1);
+  if (len > sizeof(log_line) - 2)
+    len = sizeof(log_line) - 2;
+  strcpy(log_line + len, "\n");
+
+  printf("%s", log_line);
+  syslog(LOG_NOTICE, "%s", log_line);
+
+  // write to log file if enabled
+  if (*fp)
+    write_log(fp, log_line);
+}
+
 void printbuf(uint8_t *buf, unsigned int count)
 {
   unsigned int idx = 0;
@@ -356,41 +560,119 @@ void printbuf(uint8_t *buf, unsigned int count)
   printf("\n");
 }
 
-int16_t readserial(mems_info *info, uint8_t *buffer, uint16_t quantity)
+/**
+ * Reads one frame type (or both) back-to-back for a fixed time, then writes
+ * the captured samples to stdout and the log file (if one is open) with
+ * their time from the start of the capture.
+ */
+bool burst_mode(mems_info *info, readmems_config *config, FILE **fp)
 {
-  int16_t bytesread = -1;
+  mems_burst burst;
+  mems_data data;
+  uint64_t fields = 0;
+  uint32_t seconds = atoi(config->burst_seconds);
+  uint32_t idx;
+  char line[256];
 
-#if defined(WIN32)
-  DWORD w32BytesRead = 0;
+  if (strcasecmp(config->burst_frame, "80") != 0)
+  {
+    fields |= MEMS_FIELD(lambda_voltage_mv);
+  }
 
-  if ((ReadFile(info->sd, (UCHAR *)buffer, quantity, &w32BytesRead, NULL) == TRUE) && (w32BytesRead > 0))
+  if (strcasecmp(config->burst_frame, "7d") != 0)
   {
-    bytesread = w32BytesRead;
+    fields |= MEMS_FIELD(engine_rpm);
   }
-#else
-  bytesread = read(info->sd, buffer, quantity);
-#endif
 
-  return bytesread;
+  // a 9600 baud link delivers fewer than 30 frames per second, so this
+  // leaves plenty of room
+  if (!mems_burst_init(&burst, seconds * 100))
+  {
+    printf("Error: unable to allocate burst buffer.\n");
+    return false;
+  }
+
+  printf("capturing for %u seconds...\n", seconds);
+  syslog(LOG_NOTICE, "burst capture for %u seconds", seconds);
+
+  if (mems_burst_capture(info, &burst, fields, seconds * 1000))
+  {
+    sprintf(line, "#time_us,engine_rpm,map_kpa,lambda_voltage_mv,lambda_sensor_frequency,closed_loop,short_term_fuel_trim,raw80,raw7d\n");
+    printf("%s", line);
+    write_log(fp, line);
+
+    for (idx = 0; idx < burst.count; idx++)
+    {
+      mems_burst_decode(&burst, idx, &data);
+
+      sprintf(line, "%llu,%d,%f,%d,%d,%d,%d,%s,%s\n",
+              (unsigned long long)(burst.samples[idx].timestamp_us - burst.started_us),
+              data.engine_rpm, data.map_kpa, data.lambda_voltage_mv, data.lambda_sensor_frequency,
+              data.closed_loop, data.short_term_fuel_trim, data.raw80, data.raw7d);
+      printf("%s", line);
+      write_log(fp, line);
+    }
+  }
+
+  printf("captured %u samples in %u ms (%.1f per second), %u failed\n",
+         burst.count, (unsigned int)(burst.elapsed_us / 1000),
+         burst.elapsed_us ? (burst.count * 1000000.0 / burst.elapsed_us) : 0.0, burst.errors);
+  syslog(LOG_NOTICE, "captured %u samples in %u ms, %u failed",
+         burst.count, (unsigned int)(burst.elapsed_us / 1000), burst.errors);
+
+  mems_burst_cleanup(&burst);
+
+  return (burst.count > 0);
 }
 
-int16_t writeserial(mems_info *info, uint8_t *buffer, uint16_t quantity)
+/**
+ * Prints one set of latency percentiles.
+ */
+void print_latency(const char *name, mems_latency_stats *stats)
 {
-  int16_t byteswritten = -1;
+  printf("%-16s %6u samples  p50 %6uus  p90 %6uus  p99 %6uus  max %6uus\n",
+         name, stats->count, stats->p50_us, stats->p90_us, stats->p99_us, stats->max_us);
+  syslog(LOG_NOTICE, "%s: %u samples, p50 %uus, p90 %uus, p99 %uus, max %uus",
+         name, stats->count, stats->p50_us, stats->p90_us, stats->p99_us, stats->max_us);
+}
 
-#if defined(WIN32)
-  DWORD w32BytesWritten = 0;
+/**
+ * Measures the latency of the link and applies the read timeout it
+ * recommends, then lowers the read rate to what the link can sustain, so
+ * that the samples logged afterwards use the calibrated settings.
+ * @param rate Read rate in samples per second (0 for as fast as possible);
+ *   capped at the recommended maximum
+ */
+bool calibrate_mode(mems_info *info, float *rate)
+{
+  mems_calibration cal;
+  bool success;
 
-  if ((WriteFile(info->sd, (UCHAR *)buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
-      (w32BytesWritten == quantity))
+  printf("calibrating link...\n");
+  success = mems_calibrate(info, 50, true, &cal);
+
+  print_latency("echo latency", &cal.echo);
+  print_latency("inter-byte gap", &cal.byte_gap);
+  print_latency("frame round trip", &cal.frame_rtt);
+
+  printf("%u failed probes\n", cal.errors);
+  printf("recommended read timeout %ums, maximum rate %.1f samples per second\n",
+         cal.read_timeout_ms, cal.max_rate_hz);
+  syslog(LOG_NOTICE, "recommended read timeout %ums, maximum rate %.1f samples per second",
+         cal.read_timeout_ms, cal.max_rate_hz);
+
+  if (success)
   {
-    byteswritten = w32BytesWritten;
+    if ((cal.max_rate_hz > 0) && ((*rate <= 0) || (*rate > cal.max_rate_hz)))
+    {
+      *rate = cal.max_rate_hz;
+    }
+
+    printf("reading at %.1f samples per second with a %ums read timeout\n", *rate, info->read_timeout_ms);
+    syslog(LOG_NOTICE, "reading at %.1f samples per second with a %ums read timeout", *rate, info->read_timeout_ms);
   }
-#else
-  byteswritten = write(info->sd, buffer, quantity);
-#endif
 
-  return byteswritten;
+  return success;
 }
 
 bool interactive_mode(mems_info *info, uint8_t *response_buffer)
@@ -417,13 +699,13 @@ bool interactive_mode(mems_info *info, uint8_t *response_buffer)
         icmd = strtoul(icmd_buf_ptr, NULL, 16);
         if ((icmd >= 0) && (icmd <= 0xff))
         {
-          if (writeserial(info, &icmd, 1) == 1)
+          if (info->transport->write(info, &icmd, 1) == 1)
           {
             bytes_read = 0;
             total_bytes_read = 0;
             do
             {
-              bytes_read = readserial(info, response_buffer + total_bytes_read, 1);
+              bytes_read = info->transport->read(info, response_buffer + total_bytes_read, 1);
               total_bytes_read += bytes_read;
             } while (bytes_read > 0);
 
@@ -469,18 +751,32 @@ int main(int argc, char **argv)
 {
   bool success = false;
   int cmd_idx = -1;
+#if !defined(WIN32)
+  mems_stream stream;
+  mems_stream_stats stream_stats;
+  mems_sample sample;
+#else
   mems_data data;
+  mems_scheduler sched;
+  mems_scheduler_stats sched_stats;
+#endif
+  float read_rate;
   mems_data_frame_80 frame80;
   mems_data_frame_7d frame7d;
   librosco_version ver;
   mems_info info;
+  mems_link_stats link_stats;
+  mems_serial_latency serial_latency;
+  mems_adaptive_rate adaptive;
+  mems_supervisor supervisor;
+  mems_iac_result iac_result;
   uint8_t *frameptr;
   uint8_t bufidx;
   uint8_t readval = 0;
   uint8_t iac_limit_count = 80; // number of times to re-send an IAC move command when
-  char log_line[1024];
   char *port;
   bool connected = false;
+  bool resumed = false;
   bool wait_for_connection = false;
   bool log_to_file = false;
   FILE *fp = NULL;
@@ -606,6 +902,37 @@ int main(int argc, char **argv)
 
   mems_init(&info);
 
+  // non-blocking reads wait on poll() rather than the 100ms termios timer
+  if (strcmp(config.io, "nonblocking") == 0)
+  {
+    if (!mems_set_nonblocking(&info, true))
+    {
+      printf("non-blocking serial reads are not supported, using blocking reads\n");
+    }
+  }
+
+  // request the 0x7D frame while the 0x80 frame is still arriving
+  if (strcmp(config.pipelined, "yes") == 0)
+  {
+    mems_set_pipelined(&info, true);
+  }
+
+  if (strcmp(config.low_latency, "yes") == 0)
+  {
+    mems_set_low_latency(&info, true);
+  }
+
+  // number of samples to read per second, 0 to read as fast as possible
+  read_rate = (float)atof(config.rate);
+
+  // slow down while the engine is stopped or steady, if configured
+  mems_adaptive_init(&adaptive, read_rate);
+  adaptive.rate_steady = (float)atof(config.rate_steady);
+  adaptive.rate_stopped = (float)atof(config.rate_stopped);
+  adaptive.rpm_threshold = atoi(config.rpm_threshold);
+  adaptive.throttle_threshold = atoi(config.throttle_threshold);
+  adaptive.steady_samples = atoi(config.steady_samples);
+
 #if defined(WIN32)
   // correct for microsoft's legacy nonsense by prefixing with "\\.\"
   strcpy(win32devicename, "\\\\.\\");
@@ -615,6 +942,13 @@ int main(int argc, char **argv)
   port = config.port;
 #endif
 
+  // a previous run may have left the ECU session live; if so, its D0 reply
+  // can be reused instead of repeating the handshake
+  if (load_d0_cache(config.d0cache, response_buffer))
+  {
+    mems_set_d0_response(&info, response_buffer);
+  }
+
   syslog(LOG_NOTICE, "attempting to connect to %s..", port);
 
   do
@@ -646,6 +980,19 @@ int main(int argc, char **argv)
   {
     syslog(LOG_NOTICE, "connected to ECU");
 
+    mems_get_serial_latency(&info, &serial_latency);
+    if (serial_latency.requested)
+    {
+      printf("low-latency mode %s\n", serial_latency.active ? "enabled" : "not supported by this device");
+      syslog(LOG_NOTICE, "low-latency mode %s", serial_latency.active ? "enabled" : "not supported by this device");
+    }
+
+    if (serial_latency.latency_timer_ms >= 0)
+    {
+      printf("adapter latency timer is %dms\n", serial_latency.latency_timer_ms);
+      syslog(LOG_NOTICE, "adapter latency timer is %dms", serial_latency.latency_timer_ms);
+    }
+
     // flash LED 3 times on connect
     led_flash(3, 50);
 
@@ -658,8 +1005,18 @@ int main(int argc, char **argv)
       syslog(LOG_NOTICE, "logging to %s\n", config.output);
     }
 
-    if (mems_init_link(&info, response_buffer))
+    if ((strcmp(config.fast_connect, "yes") == 0) ?
+        mems_init_link_fast(&info, response_buffer, MEMS_DEFAULT_PROBE_MS, &resumed) :
+        mems_init_link(&info, response_buffer))
     {
+      if (resumed)
+      {
+        printf("resumed existing ECU session\n");
+        syslog(LOG_NOTICE, "resumed existing ECU session");
+      }
+
+      save_d0_cache(config.d0cache, response_buffer);
+
       printf("ECU responded to D0 command with: %02X %02X %02X %02X\n\n",
              response_buffer[0], response_buffer[1], response_buffer[2], response_buffer[3]);
 
@@ -669,92 +1026,106 @@ int main(int argc, char **argv)
       // flash LED 5 times on intialisation
       led_flash(5, 100);
 
+      // reconnect if the link is lost while reading (e.g. the ignition is cycled)
+      mems_supervisor_init(&supervisor, &info, port);
+      mems_supervisor_set_callback(&supervisor, report_link_change, NULL);
+
       switch (cmd_idx)
       {
+      case MC_Calibrate:
+        if (!calibrate_mode(&info, &read_rate))
+        {
+          break;
+        }
+
+        adaptive.rate_max = read_rate;
+        adaptive.rate = read_rate;
+        // fall through
+
       case MC_Read:
         // create header
         write_memsscan_header(fp);
 
+#if !defined(WIN32)
+        // poll the ECU on a background thread so that formatting and logging
+        // the previous sample never delays the next read
+        if (!mems_stream_start(&stream, &info, 64, read_rate))
+        {
+          printf("Error: unable to start acquisition thread.\n");
+          syslog(LOG_ERR, "Error: unable to start acquisition thread.");
+          break;
+        }
+
+        if (strcmp(config.adaptive, "yes") == 0)
+        {
+          mems_stream_set_adaptive(&stream, &adaptive);
+        }
+
+        if (strcmp(config.reconnect, "yes") == 0)
+        {
+          mems_stream_set_supervisor(&stream, &supervisor);
+        }
+
+        // only delivered samples count towards the loop, as the adaptive
+        // rates can leave more than one wait between samples
+        while (read_inf || (read_loop_count > 0))
+        {
+          if (mems_stream_wait(&stream, &sample, 2000))
+          {
+            read_loop_count -= 1;
+            led(1);
+            log_memsscan_line(&fp, &sample.data);
+
+            // determine whether we need to split the output into manageable files
+            // specify max size in Mb
+            //
+            // reading from MEMS at ~1 readings per second
+            // 240Kb will record in 20 minute chunks
+            config.output = split_log_file(&fp, 240000);
+
+            led(0);
+            success = true;
+          }
+        }
+
+        mems_stream_stop(&stream);
+        mems_stream_get_stats(&stream, &stream_stats);
+        printf("read %u samples, %u dropped by slow output, %u failed reads\n",
+               stream_stats.samples, stream_stats.overruns, stream_stats.read_errors);
+        syslog(LOG_NOTICE, "read %u samples, %u dropped by slow output, %u failed reads",
+               stream_stats.samples, stream_stats.overruns, stream_stats.read_errors);
+        printf("%u polling periods missed, jitter mean %uus max %uus, %u rate changes\n",
+               stream_stats.missed, stream_stats.jitter_mean_us, stream_stats.jitter_max_us,
+               stream_stats.rate_changes);
+        syslog(LOG_NOTICE, "%u polling periods missed, jitter mean %uus max %uus, %u rate changes",
+               stream_stats.missed, stream_stats.jitter_mean_us, stream_stats.jitter_max_us,
+               stream_stats.rate_changes);
+
+        mems_get_link_stats(&info, &link_stats);
+        printf("%u frames recovered after %u retries, %u lost, %u resyncs\n",
+               link_stats.recovered, link_stats.retries, link_stats.failures, link_stats.resyncs);
+        syslog(LOG_NOTICE, "%u frames recovered after %u retries, %u lost, %u resyncs",
+               link_stats.recovered, link_stats.retries, link_stats.failures, link_stats.resyncs);
+
+        if (supervisor.losses > 0)
+        {
+          printf("link lost %u times, %u of %u reconnect attempts succeeded, last outage %ums\n",
+                 supervisor.losses, supervisor.reconnects, supervisor.attempts,
+                 (unsigned int)(supervisor.last_outage_us / 1000));
+          syslog(LOG_NOTICE, "link lost %u times, %u of %u reconnect attempts succeeded, last outage %ums",
+                 supervisor.losses, supervisor.reconnects, supervisor.attempts,
+                 (unsigned int)(supervisor.last_outage_us / 1000));
+        }
+#else
+        mems_scheduler_init(&sched, read_rate);
+
         while (read_inf || (read_loop_count-- > 0))
         {
           led(1);
 
-          if (mems_read(&info, &data))
+          if ((strcmp(config.reconnect, "yes") == 0) ? mems_supervisor_read(&supervisor, &data) : mems_read(&info, &data))
           {
-            //convert_dataframe_to_string(raw80, &data.raw80, 28);
-            //convert_dataframe_to_string(raw7d, &data.raw7d, 32);
-
-            sprintf(log_line, "%s,"
-                              "%d,%d,%d,%d,%d,%f,%f,%f,%d,%d,"
-                              "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,"
-                              "%d,%d,%d,"
-                              "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,"
-                              "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,"
-                              "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,"
-                              "80%s,7d%s\n",
-                    simple_current_time(),
-                    data.engine_rpm,
-                    data.coolant_temp_c,
-                    data.ambient_temp_c,
-                    data.intake_air_temp_c,
-                    data.fuel_temp_c,
-                    data.map_kpa,
-                    data.battery_voltage,
-                    data.throttle_pot_voltage,
-                    data.idle_switch,
-                    data.uk1,
-                    data.park_neutral_switch,
-                    data.fault_codes,
-                    data.idle_set_point,
-                    data.idle_hot,
-                    data.uk2,
-                    data.iac_position,
-                    data.idle_error,
-                    data.ignition_advance_offset,
-                    data.ignition_advance,
-                    data.coil_time,
-                    data.crankshaft_position_sensor,
-                    data.uk4,
-                    data.uk5,
-                    data.ignition_switch,
-                    data.throttle_angle,
-                    data.uk6,
-                    data.air_fuel_ratio,
-                    data.dtc2,
-                    data.lambda_voltage_mv,
-                    data.lambda_sensor_frequency,
-                    data.lambda_sensor_dutycycle,
-                    data.lambda_sensor_status,
-                    data.closed_loop,
-                    data.long_term_fuel_trim,
-                    data.short_term_fuel_trim,
-                    data.carbon_canister_dutycycle,
-                    data.dtc3,
-                    data.idle_base_pos,
-                    data.uk7,
-                    data.dtc4,
-                    data.ignition_advance2,
-                    data.idle_speed_offset,
-                    data.idle_error2,
-                    (((uint16_t)data.idle_error2 << 8) | data.uk10),
-                    data.dtc5,
-                    data.uk11,
-                    data.uk12,
-                    data.uk13,
-                    data.uk14,
-                    data.uk15,
-                    data.uk16,
-                    data.uk1A,
-                    data.uk1B,
-                    data.uk1C,
-                    data.raw7d,
-                    data.raw80);
-            printf("%s", log_line);
-            syslog(LOG_NOTICE, "%s", log_line);
-
-            // write to log file if enabled
-            if (fp)
-              write_log(&fp, log_line);
+            log_memsscan_line(&fp, &data);
 
             // determine whether we need to split the output into manageable files
             // specify max size in Mb
@@ -763,13 +1134,28 @@ int main(int argc, char **argv)
             // 240Kb will record in 20 minute chunks
             config.output = split_log_file(&fp, 240000);
 
-            // force a sleep of 450ms to get 2 readings per second
-            led(0);
-            sleep_ms(450);
+            if (strcmp(config.adaptive, "yes") == 0)
+            {
+              mems_scheduler_set_rate(&sched, mems_adaptive_update(&adaptive, &data));
+            }
 
             success = true;
           }
+
+          // wait for the next read at the configured rate, keeping the
+          // session warm (or reconnecting) in the meantime
+          led(0);
+          if (strcmp(config.reconnect, "yes") == 0)
+          {
+            mems_supervisor_idle_until(&supervisor, mems_scheduler_next_us(&sched));
+          }
+          mems_scheduler_wait(&sched);
         }
+
+        mems_scheduler_get_stats(&sched, &sched_stats);
+        printf("%u polling periods missed, jitter mean %uus max %uus\n",
+               sched_stats.missed, sched_stats.jitter_mean_us, sched_stats.jitter_max_us);
+#endif
         break;
 
       case MC_Read_Raw:
@@ -828,28 +1214,19 @@ int main(int argc, char **argv)
         break;
 
       case MC_IAC_Close:
-        do
-        {
-          success = mems_test_actuator(&info, MEMS_CloseIAC, &readval);
-
-          // For some reason, diagnostic tools will continue to send send the
-          // 'close' command many times after the IAC has already reached the
-          // fully-closed position. Emulate that behavior here.
-          if (success && (readval == 0x00))
-          {
-            iac_limit_count -= 1;
-          }
-        } while (success && iac_limit_count);
+        // For some reason, diagnostic tools will continue to send send the
+        // 'close' command many times after the IAC has already reached the
+        // fully-closed position. Emulate that behavior here.
+        success = mems_iac_move(&info, 0x00, iac_limit_count, MEMS_NO_DEADLINE, &iac_result);
+        report_iac_move(&iac_result);
         break;
 
       case MC_IAC_Open:
         // The SP Rover 1 pod considers a value of 0xB4 to represent an opened
         // IAC valve, so repeat the open command until the valve is opened to
         // that point.
-        do
-        {
-          success = mems_test_actuator(&info, MEMS_OpenIAC, &readval);
-        } while (success && (readval < 0xB4));
+        success = mems_iac_move(&info, IAC_MAXIMUM, 0, MEMS_NO_DEADLINE, &iac_result);
+        report_iac_move(&iac_result);
         break;
 
       case MC_AC:
@@ -872,6 +1249,10 @@ int main(int argc, char **argv)
         success = interactive_mode(&info, response_buffer);
         break;
 
+      case MC_Burst:
+        success = burst_mode(&info, &config, &fp);
+        break;
+
       default:
         printf("Error: invalid command\n");
         syslog(LOG_ERR, "invalid command.");
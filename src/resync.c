@@ -0,0 +1,116 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// resync.c: This file contains the recovery used after an echo
+//           mismatch or short reply: stale input is drained, the
+//           link is re-verified with a heartbeat, and the caller
+//           then retries the failed request.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Input must be quiet for this long before the drain ends; longer than
+//! the 16ms default latency timer of USB serial adapters
+#define MEMS_RESYNC_QUIET_US 20000
+
+//! Longest time spent draining, in case the line never goes quiet
+#define MEMS_RESYNC_DRAIN_US 200000
+
+/**
+ * Discards input on a connection whose mutex is already held: whatever the
+ * driver has buffered, then anything still arriving until the line has been
+ * quiet for MEMS_RESYNC_QUIET_US. Draining stops after MEMS_RESYNC_DRAIN_US
+ * or at the deadline; if the deadline has already passed, it is given one
+ * quiet period, so that the tail of a failed reply is still dropped.
+ * @param info State information for the current connection.
+ * @param deadline_us Absolute deadline, or MEMS_NO_DEADLINE
+ */
+void mems_drain_locked(mems_info *info, uint64_t deadline_us)
+{
+  uint8_t stale[64];
+  uint64_t now = mems_monotonic_us();
+  uint64_t drain_end = now + MEMS_RESYNC_DRAIN_US;
+  uint64_t wait_us;
+  int16_t count;
+
+  if ((deadline_us != MEMS_NO_DEADLINE) && (deadline_us < drain_end))
+  {
+    drain_end = (deadline_us > now) ? deadline_us : (now + MEMS_RESYNC_QUIET_US);
+  }
+
+  info->transport->flush(info);
+
+  // the rest of a reply may still be on the wire (or in the adapter)
+  while ((now = mems_monotonic_us()) < drain_end)
+  {
+    wait_us = drain_end - now;
+    if (wait_us > MEMS_RESYNC_QUIET_US)
+    {
+      wait_us = MEMS_RESYNC_QUIET_US;
+    }
+
+    if (!info->transport->wait_readable(info, wait_us) ||
+        ((count = info->transport->read(info, stale, sizeof(stale))) <= 0))
+    {
+      break;
+    }
+
+    info->link_stats.discarded += count;
+  }
+}
+
+/**
+ * Brings a connection whose mutex is already held back to a known state
+ * after a failed request: drains the input with mems_drain_locked(), and
+ * then checks that the ECU answers a heartbeat.
+ * @param info State information for the current connection.
+ * @param deadline_us Absolute deadline for the drain and the heartbeat, or
+ *   MEMS_NO_DEADLINE
+ * @return True if the ECU answered the heartbeat
+ */
+bool mems_resync_locked(mems_info *info, uint64_t deadline_us)
+{
+  uint8_t response = 0xFF;
+  mems_command heartbeat = {MEMS_Heartbeat, 1, NULL, false};
+
+  heartbeat.reply = &response;
+  info->link_stats.resyncs += 1;
+
+  mems_drain_locked(info, deadline_us);
+
+  if (mems_transact_locked(info, &heartbeat, 1, deadline_us) != 1)
+  {
+    dprintf_err("mems_resync(): ECU did not answer heartbeat after resync\n");
+    info->link_stats.resync_failures += 1;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Sets the number of times a data frame that could not be read is
+ * requested again, after resynchronising the link, before the read fails.
+ * @param info State information for the current connection.
+ * @param retries Number of retries (0 to fail at once), limited to
+ *   MEMS_MAX_RETRIES
+ */
+void mems_set_max_retries(mems_info *info, uint8_t retries)
+{
+  info->max_retries = (retries > MEMS_MAX_RETRIES) ? MEMS_MAX_RETRIES : retries;
+}
+
+/**
+ * Copies the error recovery counters of a connection.
+ * @param info State information for the current connection.
+ * @param stats Receives the counters
+ */
+void mems_get_link_stats(mems_info *info, mems_link_stats *stats)
+{
+  if (mems_lock(info))
+  {
+    memcpy(stats, &info->link_stats, sizeof(mems_link_stats));
+    mems_unlock(info);
+  }
+}
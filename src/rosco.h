@@ -31,6 +31,151 @@ extern "C"
 
 #define IAC_MAXIMUM 0xB4
 
+//! Most step commands sent in one IAC move to reach the target
+#define MEMS_IAC_MAX_STEPS 300
+
+//! Most extra step commands sent once an IAC move has reached its target
+#define MEMS_IAC_MAX_EXTRA_STEPS 300
+
+//! Consecutive steps without a change in position after which the valve is considered stalled
+#define MEMS_IAC_STALL_STEPS 20
+
+//! Defaults for the adaptive polling policy
+#define MEMS_ADAPTIVE_DEFAULT_RATE_STEADY 0.5
+#define MEMS_ADAPTIVE_DEFAULT_RATE_STOPPED 0.2
+#define MEMS_ADAPTIVE_DEFAULT_RPM_THRESHOLD 50
+#define MEMS_ADAPTIVE_DEFAULT_THROTTLE_THRESHOLD 2
+#define MEMS_ADAPTIVE_DEFAULT_STEADY_SAMPLES 10
+
+//! Default time allowed for the first byte of a reply to arrive (non-blocking mode)
+#define MEMS_DEFAULT_READ_TIMEOUT_MS 100
+
+//! Passed as the deadline to the _timed functions to use the port's own read timeout
+#define MEMS_NO_DEADLINE 0
+
+//! Default number of times a failed data frame is requested again
+#define MEMS_DEFAULT_MAX_RETRIES 2
+
+//! Most retries mems_set_max_retries() accepts; each can take a resync and a frame time
+#define MEMS_MAX_RETRIES 10
+
+//! Default time allowed for the heartbeat that checks for a live session in mems_init_link_fast()
+#define MEMS_DEFAULT_PROBE_MS 50
+
+//! Defaults for the reconnect supervisor
+#define MEMS_SUPERVISOR_DEFAULT_BACKOFF_MIN_MS 20
+#define MEMS_SUPERVISOR_DEFAULT_BACKOFF_MAX_MS 1000
+#define MEMS_SUPERVISOR_DEFAULT_HEARTBEAT_MS 1000
+#define MEMS_SUPERVISOR_DEFAULT_FAILURE_LIMIT 3
+
+//! Port name that connects to the in-memory simulated ECU instead of a device
+#define MEMS_LOOPBACK_PORT "loopback"
+
+//! Largest reply (echo plus data) the simulated ECU will send
+#define MEMS_ECUSIM_MAX_REPLY (1 + sizeof(mems_data_frame_7d))
+
+//! Flags recording which data frames have been received
+#define MEMS_Frame80_Ready 0x01
+#define MEMS_Frame7D_Ready 0x02
+
+/**
+ * Fields of mems_data that hold values, each with the data frame and byte
+ * offset (counting the length byte) it is decoded from, and how it is
+ * decoded:
+ *   MEMS_Kind_Linear  byte * scale + bias
+ *   MEMS_Kind_Word    big-endian 16-bit value at offset, * scale + bias
+ *   MEMS_Kind_Switch  1 if the byte is non-zero, otherwise 0
+ *   MEMS_Kind_Bit     true if the byte has the bits in scale set
+ *   MEMS_Kind_Faults  fault code bits gathered from the bytes at offset and offset + 1
+ * The last column is the name published in log headers and schemas, which
+ * keeps the names used by MEMS-Scan where they differ from the member.
+ * This table is the only description of the frame layout: the decoders,
+ * the accessors for mems_compact_sample, the batch decoder, the field
+ * descriptors and the CSV formatter are all generated from it.
+ */
+#define MEMS_DATA_VALUES(X)                                                                                               \
+  X(engine_rpm, int, MEMS_Frame80_Ready, 0x01, MEMS_Kind_Word, 1, 0, "engine-rpm")                                        \
+  X(coolant_temp_c, int, MEMS_Frame80_Ready, 0x03, MEMS_Kind_Linear, 1, -55, "coolant_temp")                              \
+  X(ambient_temp_c, int, MEMS_Frame80_Ready, 0x04, MEMS_Kind_Linear, 1, -55, "ambient_temp")                              \
+  X(intake_air_temp_c, int, MEMS_Frame80_Ready, 0x05, MEMS_Kind_Linear, 1, -55, "intake_air_temp")                        \
+  X(fuel_temp_c, int, MEMS_Frame80_Ready, 0x06, MEMS_Kind_Linear, 1, -55, "fuel_temp")                                    \
+  X(map_kpa, float, MEMS_Frame80_Ready, 0x07, MEMS_Kind_Linear, 1, 0, "map_kpa")                                          \
+  X(battery_voltage, float, MEMS_Frame80_Ready, 0x08, MEMS_Kind_Linear, 0.1, 0, "battery_voltage")                        \
+  X(throttle_pot_voltage, float, MEMS_Frame80_Ready, 0x09, MEMS_Kind_Linear, 0.02, 0, "throttle_pot")                     \
+  X(idle_switch, int, MEMS_Frame80_Ready, 0x0A, MEMS_Kind_Switch, 1, 0, "idle_switch")                                    \
+  X(uk1, int, MEMS_Frame80_Ready, 0x0B, MEMS_Kind_Linear, 1, 0, "uk1")                                                    \
+  X(park_neutral_switch, int, MEMS_Frame80_Ready, 0x0C, MEMS_Kind_Switch, 1, 0, "park_neutral_switch")                    \
+  X(fault_codes, int, MEMS_Frame80_Ready, 0x0D, MEMS_Kind_Faults, 1, 0, "fault_codes")                                    \
+  X(idle_set_point, int, MEMS_Frame80_Ready, 0x0F, MEMS_Kind_Linear, 1, 0, "idle_set_point")                              \
+  X(idle_hot, int, MEMS_Frame80_Ready, 0x10, MEMS_Kind_Linear, 1, 0, "idle_hot")                                          \
+  X(uk2, int, MEMS_Frame80_Ready, 0x11, MEMS_Kind_Linear, 1, 0, "uk2")                                                    \
+  X(iac_position, int, MEMS_Frame80_Ready, 0x12, MEMS_Kind_Linear, 1, 0, "iac_position")                                  \
+  X(idle_error, int, MEMS_Frame80_Ready, 0x13, MEMS_Kind_Word, 1, 0, "idle_error")                                        \
+  X(ignition_advance_offset, int, MEMS_Frame80_Ready, 0x15, MEMS_Kind_Linear, 1, 0, "ignition_advance_offset")            \
+  X(ignition_advance, int, MEMS_Frame80_Ready, 0x16, MEMS_Kind_Linear, 0.5, -24, "ignition_advance")                      \
+  X(coil_time, int, MEMS_Frame80_Ready, 0x17, MEMS_Kind_Word, 0.002, 0, "coil_time")                                      \
+  X(crankshaft_position_sensor, int, MEMS_Frame80_Ready, 0x19, MEMS_Kind_Linear, 1, 0, "crankshaft_position_sensor")      \
+  X(uk4, int, MEMS_Frame80_Ready, 0x1A, MEMS_Kind_Linear, 1, 0, "uk4")                                                    \
+  X(uk5, int, MEMS_Frame80_Ready, 0x1B, MEMS_Kind_Linear, 1, 0, "uk5")                                                    \
+  X(ignition_switch, int, MEMS_Frame7D_Ready, 0x01, MEMS_Kind_Linear, 1, 0, "ignition_switch")                            \
+  X(throttle_angle, int, MEMS_Frame7D_Ready, 0x02, MEMS_Kind_Linear, 1, 0, "throttle_angle")                              \
+  X(uk6, int, MEMS_Frame7D_Ready, 0x03, MEMS_Kind_Linear, 1, 0, "uk6")                                                    \
+  X(air_fuel_ratio, int, MEMS_Frame7D_Ready, 0x04, MEMS_Kind_Linear, 1, 0, "air_fuel_ratio")                              \
+  X(dtc2, int, MEMS_Frame7D_Ready, 0x05, MEMS_Kind_Linear, 1, 0, "dtc2")                                                  \
+  X(lambda_voltage_mv, int, MEMS_Frame7D_Ready, 0x06, MEMS_Kind_Linear, 5, 0, "lambda_voltage")                           \
+  X(lambda_sensor_frequency, int, MEMS_Frame7D_Ready, 0x07, MEMS_Kind_Linear, 1, 0, "lambda_sensor_frequency")            \
+  X(lambda_sensor_dutycycle, int, MEMS_Frame7D_Ready, 0x08, MEMS_Kind_Linear, 1, 0, "lambda_sensor_dutycycle")            \
+  X(lambda_sensor_status, int, MEMS_Frame7D_Ready, 0x09, MEMS_Kind_Linear, 1, 0, "lambda_sensor_status")                  \
+  X(closed_loop, int, MEMS_Frame7D_Ready, 0x0A, MEMS_Kind_Linear, 1, 0, "closed_loop")                                    \
+  X(long_term_fuel_trim, int, MEMS_Frame7D_Ready, 0x0B, MEMS_Kind_Linear, 1, 0, "long_term_fuel_trim")                    \
+  X(short_term_fuel_trim, int, MEMS_Frame7D_Ready, 0x0C, MEMS_Kind_Linear, 1, 0, "short_term_fuel_trim")                  \
+  X(carbon_canister_dutycycle, int, MEMS_Frame7D_Ready, 0x0D, MEMS_Kind_Linear, 1, 0, "carbon_canister_dutycycle")        \
+  X(dtc3, int, MEMS_Frame7D_Ready, 0x0E, MEMS_Kind_Linear, 1, 0, "dtc3")                                                  \
+  X(idle_base_pos, int, MEMS_Frame7D_Ready, 0x0F, MEMS_Kind_Linear, 1, 0, "idle_base_pos")                                \
+  X(uk7, int, MEMS_Frame7D_Ready, 0x10, MEMS_Kind_Linear, 1, 0, "uk7")                                                    \
+  X(dtc4, int, MEMS_Frame7D_Ready, 0x11, MEMS_Kind_Linear, 1, 0, "dtc4")                                                  \
+  X(ignition_advance2, int, MEMS_Frame7D_Ready, 0x12, MEMS_Kind_Linear, 1, 0, "ignition_advance2")                        \
+  X(idle_speed_offset, int, MEMS_Frame7D_Ready, 0x13, MEMS_Kind_Linear, 1, 0, "idle_speed_offset")                        \
+  X(idle_error2, int, MEMS_Frame7D_Ready, 0x14, MEMS_Kind_Linear, 1, 0, "idle_error2")                                    \
+  X(uk10, int, MEMS_Frame7D_Ready, 0x15, MEMS_Kind_Linear, 1, 0, "uk10")                                                  \
+  X(dtc5, int, MEMS_Frame7D_Ready, 0x16, MEMS_Kind_Linear, 1, 0, "dtc5")                                                  \
+  X(uk11, int, MEMS_Frame7D_Ready, 0x17, MEMS_Kind_Linear, 1, 0, "uk11")                                                  \
+  X(uk12, int, MEMS_Frame7D_Ready, 0x18, MEMS_Kind_Linear, 1, 0, "uk12")                                                  \
+  X(uk13, int, MEMS_Frame7D_Ready, 0x19, MEMS_Kind_Linear, 1, 0, "uk13")                                                  \
+  X(uk14, int, MEMS_Frame7D_Ready, 0x1A, MEMS_Kind_Linear, 1, 0, "uk14")                                                  \
+  X(uk15, int, MEMS_Frame7D_Ready, 0x1B, MEMS_Kind_Linear, 1, 0, "uk15")                                                  \
+  X(uk16, int, MEMS_Frame7D_Ready, 0x1C, MEMS_Kind_Linear, 1, 0, "uk16")                                                  \
+  X(uk1A, int, MEMS_Frame7D_Ready, 0x1D, MEMS_Kind_Linear, 1, 0, "uk17")                                                  \
+  X(uk1B, int, MEMS_Frame7D_Ready, 0x1E, MEMS_Kind_Linear, 1, 0, "uk18")                                                  \
+  X(uk1C, int, MEMS_Frame7D_Ready, 0x1F, MEMS_Kind_Linear, 1, 0, "uk19")                                                  \
+  X(coolant_temp_sensor_fault, bool, MEMS_Frame80_Ready, 0x0D, MEMS_Kind_Bit, 0x01, 0, "coolant_temp_sensor_fault")       \
+  X(intake_air_temp_sensor_fault, bool, MEMS_Frame80_Ready, 0x0D, MEMS_Kind_Bit, 0x02, 0, "intake_air_temp_sensor_fault") \
+  X(fuel_pump_circuit_fault, bool, MEMS_Frame80_Ready, 0x0E, MEMS_Kind_Bit, 0x02, 0, "fuel_pump_circuit_fault")           \
+  X(throttle_pot_circuit_fault, bool, MEMS_Frame80_Ready, 0x0E, MEMS_Kind_Bit, 0x80, 0, "throttle_pot_circuit_fault")
+
+/**
+ * Every field of mems_data: the values above, followed by the raw frames as
+ * hex strings (MEMS_Kind_Raw). Used to build field masks for
+ * mems_read_fields().
+ */
+#define MEMS_DATA_FIELDS(X)                                            \
+  MEMS_DATA_VALUES(X)                                                  \
+  X(raw7d, char, MEMS_Frame7D_Ready, 0x00, MEMS_Kind_Raw, 0, 0, "raw") \
+  X(raw80, char, MEMS_Frame80_Ready, 0x00, MEMS_Kind_Raw, 0, 0, "raw")
+
+//! Bit for a mems_data field in a field mask, e.g. MEMS_FIELD(engine_rpm)
+#define MEMS_FIELD(member) ((uint64_t)1 << MEMS_Field_##member)
+
+//! Field mask selecting every field
+#define MEMS_ALL_FIELDS (((uint64_t)1 << MEMS_Field_Count) - 1)
+
+//! Fields written to the MEMS-Scan CSV log: all but the fault code flags,
+//! which it carries in fault_codes
+#define MEMS_CSV_FIELDS (MEMS_ALL_FIELDS & ~(MEMS_FIELD(coolant_temp_sensor_fault) |    \
+                                             MEMS_FIELD(intake_air_temp_sensor_fault) | \
+                                             MEMS_FIELD(fuel_pump_circuit_fault) |      \
+                                             MEMS_FIELD(throttle_pot_circuit_fault)))
+
 #if defined RPI
 
 #endif
@@ -170,6 +315,83 @@ extern "C"
     uint8_t uk5;
   } mems_data_frame_80;
 
+  /**
+ * One step of a transaction run by mems_transact().
+ */
+  typedef struct
+  {
+    //! Command byte to send (the ECU echoes it before any reply)
+    uint8_t command;
+    //! Number of bytes the ECU sends after the echo
+    uint8_t reply_len;
+    //! Receives the reply (at least reply_len bytes), or NULL to discard it
+    uint8_t *reply;
+    //! Set if the echo and the complete reply were received
+    bool ok;
+  } mems_command;
+
+  /**
+ * Outcome of an idle air control move made by mems_iac_move().
+ */
+  typedef struct
+  {
+    //! Position reported before the move
+    uint8_t start_position;
+    //! Position reported in reply to the last step
+    uint8_t final_position;
+    //! Step commands acknowledged by the ECU
+    uint16_t steps;
+    //! Time taken by the whole move
+    uint64_t elapsed_us;
+    //! The valve reached the desired position (before any extra steps)
+    bool reached;
+    //! The valve stopped moving before reaching the desired position
+    bool stalled;
+  } mems_iac_result;
+
+  /**
+ * States of the incremental data frame parser.
+ */
+  typedef enum
+  {
+    //! Waiting for the echo of a 0x80 or 0x7D request
+    MEMS_Parse_Echo,
+    //! Echo seen; waiting for the bytes_in_frame byte
+    MEMS_Parse_Length,
+    //! Collecting the remainder of the frame
+    MEMS_Parse_Payload,
+    //! Discarding unexpected bytes until a plausible echo is seen
+    MEMS_Parse_Resync
+  } mems_parse_state;
+
+  /**
+ * Push-style parser that recovers complete, validated data frames from
+ * whatever bytes have been received so far. See mems_parser_feed().
+ */
+  typedef struct
+  {
+    mems_parse_state state;
+    //! Echoed command whose frame is being collected
+    uint8_t command;
+    //! bytes_in_frame expected for that command
+    uint8_t expected;
+    //! Number of frame bytes collected so far
+    uint8_t pos;
+    //! Most recently completed (or partially collected) frame
+    union
+    {
+      mems_data_frame_80 f80;
+      mems_data_frame_7d f7d;
+      uint8_t bytes[sizeof(mems_data_frame_7d)];
+    } frame;
+    //! Number of complete frames parsed
+    uint32_t frames;
+    //! Number of times the parser lost and had to regain frame alignment
+    uint32_t resyncs;
+    //! Number of bytes thrown away while resynchronising
+    uint32_t discarded;
+  } mems_parser;
+
   /**
  * Compact structure containing only the relevant data from the ECU.
  */
@@ -244,8 +466,147 @@ extern "C"
     bool throttle_pot_circuit_fault;
     char raw7d[100];
     char raw80[100];
+    //! Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready for the
+    //! frames these fields were decoded from; other fields are stale
+    uint8_t frames;
   } mems_data;
 
+  /**
+ * How a field is decoded from its data frame (see MEMS_DATA_FIELDS).
+ */
+  typedef enum
+  {
+    MEMS_Kind_Linear,
+    MEMS_Kind_Word,
+    MEMS_Kind_Switch,
+    MEMS_Kind_Bit,
+    MEMS_Kind_Faults,
+    MEMS_Kind_Raw
+  } mems_field_kind;
+
+#define MEMS_FIELD_ENUM(member, type, frame, offset, kind, scale, bias, name) MEMS_Field_##member,
+
+  /**
+ * Index of each mems_data field in a field mask.
+ */
+  typedef enum
+  {
+    MEMS_DATA_FIELDS(MEMS_FIELD_ENUM)
+    MEMS_Field_Count
+  } mems_field;
+
+#undef MEMS_FIELD_ENUM
+
+  /**
+ * Description of one field, generated from MEMS_DATA_FIELDS, for building
+ * log headers and schemas (see mems_describe_field()).
+ */
+  typedef struct
+  {
+    //! Name of the mems_data member
+    const char *member;
+    //! Name published in log headers
+    const char *name;
+    //! MEMS_Frame80_Ready or MEMS_Frame7D_Ready
+    uint8_t frame;
+    //! Byte offset in the frame, counting the length byte
+    uint8_t offset;
+    mems_field_kind kind;
+    double scale;
+    double bias;
+  } mems_field_descriptor;
+
+  /**
+ * Decoded data with the time at which its read was started.
+ */
+  typedef struct
+  {
+    //! Time from mems_monotonic_us()
+    uint64_t timestamp_us;
+    mems_data data;
+  } mems_sample;
+
+  /**
+ * A sample kept as the raw frames it was read as (72 bytes, against about
+ * 450 for a decoded mems_sample), for ring buffers, history and binary
+ * logs. Fields are decoded on demand with the generated accessors, e.g.
+ * mems_compact_engine_rpm(&sample), or all at once with
+ * mems_decode_compact().
+ */
+  typedef struct
+  {
+    //! Time from mems_monotonic_us() at which the read was started
+    uint64_t timestamp_us;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+    //! Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready for the frames received
+    uint8_t frames;
+  } mems_compact_sample;
+
+  /**
+ * Decodes one field from a raw frame as described by MEMS_DATA_VALUES.
+ * With constant arguments (as in the accessors) this reduces to the few
+ * operations the field needs.
+ */
+  static inline double mems_decode_field(const uint8_t *frame, uint8_t offset, mems_field_kind kind, double scale, double bias)
+  {
+    switch (kind)
+    {
+    case MEMS_Kind_Word:
+      return ((((uint16_t)frame[offset] << 8) | frame[offset + 1]) * scale) + bias;
+    case MEMS_Kind_Switch:
+      return (frame[offset] != 0);
+    case MEMS_Kind_Bit:
+      return ((frame[offset] & (uint8_t)scale) != 0);
+    case MEMS_Kind_Faults:
+      return (frame[offset] & 0x03) | ((frame[offset + 1] & 0x02) << 1) | ((frame[offset + 1] & 0x80) >> 4);
+    default:
+      return (frame[offset] * scale) + bias;
+    }
+  }
+
+#define MEMS_COMPACT_ACCESSOR(member, type, frame, offset, kind, scale, bias, name)                   \
+  static inline type mems_compact_##member(const mems_compact_sample *sample)                         \
+  {                                                                                                   \
+    return (type)mems_decode_field((frame == MEMS_Frame80_Ready) ? (const uint8_t *)&sample->frame80  \
+                                                                 : (const uint8_t *)&sample->frame7d, \
+                                   offset, kind, scale, bias);                                        \
+  }
+
+  MEMS_DATA_VALUES(MEMS_COMPACT_ACCESSOR)
+
+#undef MEMS_COMPACT_ACCESSOR
+
+  /**
+ * A sample whose fields are decoded only when first asked for, for
+ * consumers that look at a few values of each sample. Read it with
+ * mems_read_lazy() and take values with the generated accessors, e.g.
+ * mems_lazy_engine_rpm(&lazy), or mems_lazy_raw80() for a hex string; each
+ * field is decoded once and then kept in data.
+ */
+  typedef struct
+  {
+    mems_compact_sample sample;
+    //! Mask of MEMS_FIELD() bits for the members of data that are filled in
+    uint64_t valid;
+    mems_data data;
+  } mems_lazy_data;
+
+#define MEMS_LAZY_ACCESSOR(member, type, frame, offset, kind, scale, bias, name) \
+  static inline type mems_lazy_##member(mems_lazy_data *lazy)                   \
+  {                                                                              \
+    if (!(lazy->valid & MEMS_FIELD(member)))                                     \
+    {                                                                            \
+      lazy->data.member = mems_compact_##member(&lazy->sample);                  \
+      lazy->valid |= MEMS_FIELD(member);                                         \
+    }                                                                            \
+    return lazy->data.member;                                                    \
+  }
+
+  MEMS_DATA_VALUES(MEMS_LAZY_ACCESSOR)
+
+#undef MEMS_LAZY_ACCESSOR
+
   /**
  * Major/minor/patch version numbers for this build of the library
  */
@@ -259,6 +620,42 @@ extern "C"
     uint8_t patch;
   } librosco_version;
 
+  /**
+ * Error recovery counters for a connection, as reported by
+ * mems_get_link_stats().
+ */
+  typedef struct
+  {
+    //! Times stale input was drained and the link re-verified
+    uint32_t resyncs;
+    //! Resyncs after which the ECU did not answer a heartbeat
+    uint32_t resync_failures;
+    //! Bytes drained during resyncs (not counting those flushed by the driver)
+    uint32_t discarded;
+    //! Frame requests repeated after a failure
+    uint32_t retries;
+    //! Frames read successfully on a retry
+    uint32_t recovered;
+    //! Frames that could not be read within the retry budget
+    uint32_t failures;
+  } mems_link_stats;
+
+  /**
+ * Latency settings of the serial device, as reported by
+ * mems_get_serial_latency().
+ */
+  typedef struct
+  {
+    //! Low-latency mode was requested with mems_set_low_latency()
+    bool requested;
+    //! The driver accepted ASYNC_LOW_LATENCY (Linux only)
+    bool active;
+    //! USB adapter latency timer read from sysfs, or -1 if not available
+    int latency_timer_ms;
+  } mems_serial_latency;
+
+  struct mems_transport;
+
   /**
  * Contains information about the state of the current connection to the ECU.
  */
@@ -274,9 +671,388 @@ extern "C"
   int sd;
   //! Lock to prevent multiple simultaneous open/close/read/write operations
   pthread_mutex_t mutex;
+  //! Serial device is opened O_NONBLOCK and reads wait on poll() until a deadline
+  bool nonblocking;
 #endif
+    //! Time allowed for the first byte of a reply to arrive in non-blocking mode
+    uint16_t read_timeout_ms;
+    //! Send the 0x7D request without waiting for the whole 0x80 reply
+    bool pipelined;
+    //! Low-latency settings requested for and applied to the serial device
+    mems_serial_latency serial_latency;
+    //! Number of times a failed frame is requested again (after a resync)
+    uint8_t max_retries;
+    //! Reply to the 0xD0 command from the last full initialisation, reused
+    //! by mems_init_link_fast() when the ECU session is still live
+    uint8_t d0_response[4];
+    bool d0_cached;
+    mems_link_stats link_stats;
+    //! Backend used for the open connection
+    const struct mems_transport *transport;
+    //! Backend chosen with mems_set_transport(), or NULL to choose one from the port name
+    const struct mems_transport *preferred_transport;
+    //! Private state of backends that are not a device (e.g. the loopback ECU)
+    void *transport_state;
+    //! Seqlock sequence for the latest sample; odd while a write is in progress
+    uint32_t latest_seq;
+    //! Most recent sample read on this connection (see mems_get_latest())
+    mems_compact_sample latest;
   } mems_info;
 
+  /**
+ * Operations through which the library reaches the ECU. The termios serial
+ * and pty backends read and write the device descriptor; the loopback
+ * backend answers from a simulated ECU in memory.
+ */
+  typedef struct mems_transport
+  {
+    const char *name;
+    //! Opens the port; called with the connection locked
+    bool (*open)(mems_info *info, const char *path);
+    void (*close)(mems_info *info);
+    bool (*is_open)(mems_info *info);
+    //! Reads whatever is available, up to quantity bytes, waiting no longer
+    //! than the port's own read timer; returns the count or -1 on error
+    int16_t (*read)(mems_info *info, uint8_t *buffer, uint16_t quantity);
+    int16_t (*write)(mems_info *info, const uint8_t *buffer, uint16_t quantity);
+    //! Waits up to timeout_us for data to become available to read
+    bool (*wait_readable)(mems_info *info, uint64_t timeout_us);
+    //! Discards input that has been received but not read
+    void (*flush)(mems_info *info);
+    //! The backend reads and writes info->sd, which can be polled directly
+    bool has_fd;
+  } mems_transport;
+
+  extern const mems_transport mems_transport_serial;
+#if !defined(WIN32)
+  extern const mems_transport mems_transport_pty;
+#endif
+  extern const mems_transport mems_transport_loopback;
+
+  /**
+ * State of a simulated ECU. Values are stored in the raw units used by the
+ * ECU so that they can be copied directly into the data frames.
+ */
+  typedef struct
+  {
+    bool engine_running;
+    uint16_t engine_rpm;
+    uint8_t coolant_temp;
+    uint8_t iac_position;
+    uint8_t lambda_voltage;
+    //! The initialisation sequence has started a diagnostic session; until
+    //! then, only 0xCA is answered
+    bool session;
+    uint32_t tick;
+    //! Commands received
+    uint32_t commands;
+    //! Data frames sent
+    uint32_t frames80;
+    uint32_t frames7d;
+  } mems_ecusim;
+
+#if defined(linux)
+//! Maximum number of connections served by one acquisition engine
+#define MEMS_ENGINE_MAX_LINKS 16
+
+  /**
+ * Called by the acquisition engine with each decoded sample.
+ * @param context Pointer given to mems_engine_init()
+ * @param id Identifier returned by mems_engine_add() for the connection
+ * @param success False if the ECU did not reply in time; data is then NULL
+ * @param data Decoded sample, valid only for the duration of the call
+ */
+  typedef void (*mems_engine_callback)(void *context, int id, bool success, const mems_data *data);
+
+  /**
+ * State of one connection polled by the acquisition engine.
+ */
+  typedef struct
+  {
+    mems_info *info;
+    //! A 0x80/0x7D cycle is in progress and the connection mutex is held
+    bool busy;
+    //! The descriptor hung up or failed, and the link is no longer polled
+    bool dead;
+    //! Data request awaiting a reply
+    uint8_t command;
+    uint64_t deadline_us;
+    //! Time at which the current cycle started
+    uint64_t started_us;
+    mems_parser parser;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+    uint32_t samples;
+    uint32_t errors;
+  } mems_engine_link;
+
+  /**
+ * Polls several connections from one epoll event loop.
+ */
+  typedef struct
+  {
+    int epfd;
+    int count;
+    //! Time allowed for each frame to arrive after its request is sent
+    uint32_t timeout_ms;
+    bool stop;
+    mems_engine_callback callback;
+    void *context;
+    mems_engine_link links[MEMS_ENGINE_MAX_LINKS];
+  } mems_engine;
+#endif
+
+  /**
+ * One sample of a burst capture. Only the frames selected for the capture
+ * are filled in.
+ */
+  typedef struct
+  {
+    //! Time from mems_monotonic_us() at which the sample's first request was sent
+    uint64_t timestamp_us;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+  } mems_burst_sample;
+
+  /**
+ * Preallocated buffer for a burst capture made by mems_burst_capture().
+ */
+  typedef struct
+  {
+    mems_burst_sample *samples;
+    uint32_t capacity;
+    //! Samples captured by the last capture
+    uint32_t count;
+    //! Samples abandoned because a frame did not arrive in time
+    uint32_t errors;
+    //! Combination of MEMS_Frame80_Ready and MEMS_Frame7D_Ready for the frames captured
+    uint8_t frames;
+    uint64_t started_us;
+    uint64_t elapsed_us;
+  } mems_burst;
+
+#define MEMS_COLUMN_MEMBER(member, type, frame, offset, kind, scale, bias, name) type *member;
+
+  /**
+ * Decoded values of many samples stored as one contiguous array per field
+ * (struct-of-arrays), filled by mems_decode_batch(). Only the fields chosen
+ * in mems_columns_init() have an array; the others are NULL. The hex
+ * strings raw7d and raw80 have no columns.
+ */
+  typedef struct
+  {
+    //! Mask of MEMS_FIELD() bits for the fields with an array
+    uint64_t fields;
+    uint32_t capacity;
+    //! Samples decoded so far; set to 0 to reuse the arrays
+    uint32_t count;
+    MEMS_DATA_VALUES(MEMS_COLUMN_MEMBER)
+  } mems_columns;
+
+#undef MEMS_COLUMN_MEMBER
+
+  /**
+ * Percentiles of a set of latency measurements.
+ */
+  typedef struct
+  {
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+  } mems_latency_stats;
+
+  /**
+ * Link measurements and recommendations made by mems_calibrate().
+ */
+  typedef struct
+  {
+    //! Time from sending a command to receiving its echo
+    mems_latency_stats echo;
+    //! Time between consecutive bytes of a reply
+    mems_latency_stats byte_gap;
+    //! Time to read both data frames (0x80 then 0x7D)
+    mems_latency_stats frame_rtt;
+    //! Probes that failed
+    uint32_t errors;
+    //! Recommended value for mems_info.read_timeout_ms
+    uint16_t read_timeout_ms;
+    //! Highest polling rate recommended for the link, in reads per second,
+    //! with 20% headroom over the slowest data read
+    float max_rate_hz;
+  } mems_calibration;
+
+  /**
+ * Fixed-rate scheduler that paces a polling loop against the monotonic
+ * clock. Wakeups are computed from the start time rather than from the end
+ * of the previous iteration, so the rate does not drift.
+ */
+  typedef struct
+  {
+    //! Time between wakeups, or 0 to run as fast as possible
+    uint64_t period_us;
+    //! Time of the last wakeup, from mems_monotonic_us()
+    uint64_t next_us;
+    //! Calls to mems_scheduler_wait()
+    uint32_t ticks;
+    //! Periods skipped because an iteration overran
+    uint32_t missed;
+    uint64_t jitter_total_us;
+    uint64_t jitter_max_us;
+  } mems_scheduler;
+
+  /**
+ * Scheduler counters, as reported by mems_scheduler_get_stats().
+ */
+  typedef struct
+  {
+    uint32_t ticks;
+    uint32_t missed;
+    //! Mean lateness of a wakeup
+    uint32_t jitter_mean_us;
+    //! Worst lateness of a wakeup
+    uint32_t jitter_max_us;
+  } mems_scheduler_stats;
+
+  /**
+ * Polling policy that lowers the read rate while the engine is stopped or
+ * steady. Set the rates and thresholds after mems_adaptive_init(); the
+ * remaining fields are maintained by mems_adaptive_update().
+ */
+  typedef struct
+  {
+    //! Reads per second while the engine state is changing (0 = as fast as possible)
+    float rate_max;
+    //! Reads per second once the engine is running steadily
+    float rate_steady;
+    //! Reads per second once the engine is stopped (0 RPM) and steady
+    float rate_stopped;
+    //! Change in engine speed (RPM) that restores the full rate
+    int rpm_threshold;
+    //! Change in throttle angle that restores the full rate
+    int throttle_threshold;
+    //! Consecutive unchanged samples before the rate is lowered
+    uint32_t steady_samples;
+    bool primed;
+    int engine_rpm;
+    int throttle_angle;
+    int fault_codes;
+    int dtc[4];
+    uint32_t steady_count;
+    //! Rate chosen by the last update
+    float rate;
+  } mems_adaptive_rate;
+
+  /**
+ * Called by the supervisor when the link is lost (up is false) and when it
+ * has been reconnected and initialised again (up is true).
+ */
+  typedef void (*mems_supervisor_callback)(void *context, bool up);
+
+  /**
+ * Keeps a connection alive: detects a lost link, reconnects with jittered
+ * exponential backoff, and sends heartbeats while the link is idle. Set the
+ * intervals after mems_supervisor_init(); the remaining fields are
+ * maintained by the mems_supervisor_ functions, which must all be called
+ * from the same thread.
+ */
+  typedef struct
+  {
+    mems_info *info;
+    //! Copy of the port name passed to mems_connect() on each reconnect
+    char port[256];
+    //! First delay after a failed reconnect; doubles with each failure
+    uint32_t backoff_min_ms;
+    //! Longest delay between reconnect attempts
+    uint32_t backoff_max_ms;
+    //! Idle time after which a heartbeat is sent (0 = never)
+    uint32_t heartbeat_ms;
+    //! Consecutive failed reads or heartbeats that mean the link is lost
+    uint32_t failure_limit;
+    mems_supervisor_callback callback;
+    void *context;
+    bool up;
+    uint32_t consecutive_failures;
+    uint32_t backoff_ms;
+    //! Time of the next reconnect attempt, from mems_monotonic_us()
+    uint64_t next_attempt_us;
+    //! Time of the last successful exchange with the ECU
+    uint64_t last_activity_us;
+    uint64_t lost_us;
+    uint32_t random;
+    //! Times the link was lost
+    uint32_t losses;
+    //! Reconnect attempts made, and those that succeeded
+    uint32_t attempts;
+    uint32_t reconnects;
+    uint32_t heartbeats;
+    //! Time from the loss of the link to data flowing again, for the last outage
+    uint64_t last_outage_us;
+  } mems_supervisor;
+
+#if !defined(WIN32)
+  /**
+ * Counters maintained by the background acquisition thread.
+ */
+  typedef struct
+  {
+    //! Samples read successfully (including any dropped)
+    uint32_t samples;
+    //! Samples dropped because the consumer had not emptied the ring
+    uint32_t overruns;
+    //! Reads that failed
+    uint32_t read_errors;
+    //! Polling periods skipped because a read overran
+    uint32_t missed;
+    //! Mean and worst lateness of the start of a read
+    uint32_t jitter_mean_us;
+    uint32_t jitter_max_us;
+    //! Times the adaptive policy changed the polling rate
+    uint32_t rate_changes;
+  } mems_stream_stats;
+
+  /**
+ * Background acquisition thread publishing into a single-producer,
+ * single-consumer ring. Fields are shared between threads and should only
+ * be accessed through the mems_stream_ functions.
+ */
+  typedef struct
+  {
+    mems_info *info;
+    pthread_t thread;
+    bool running;
+    mems_scheduler sched;
+    //! Optional policy adjusting the scheduler's rate after each sample
+    mems_adaptive_rate *adaptive;
+    //! Optional supervisor that reads through, and reconnects, the link
+    mems_supervisor *supervisor;
+    //! Samples are kept undecoded and decoded as the consumer takes them
+    mems_compact_sample *ring;
+    //! Number of slots in the ring (a power of two)
+    uint32_t capacity;
+    //! Count of samples published (written only by the acquisition thread)
+    uint32_t head;
+    //! Count of samples consumed (written only by the consumer)
+    uint32_t tail;
+    uint32_t samples;
+    uint32_t overruns;
+    uint32_t read_errors;
+    //! Copied from the scheduler so that they can be read from another thread
+    uint32_t missed;
+    uint32_t jitter_mean_us;
+    uint32_t jitter_max_us;
+    uint32_t rate_changes;
+    //! Used only to wake a consumer blocked in mems_stream_wait()
+    uint32_t waiters;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake;
+    //! Used only to wake the acquisition thread when the stream is stopped
+    pthread_mutex_t stop_mutex;
+    pthread_cond_t stop;
+  } mems_stream;
+#endif
+
   typedef struct
   {
     char *port;
@@ -284,6 +1060,21 @@ extern "C"
     char *output;
     char *loop;
     char *connection;
+    char *io;
+    char *pipelined;
+    char *rate;
+    char *adaptive;
+    char *rate_steady;
+    char *rate_stopped;
+    char *rpm_threshold;
+    char *throttle_threshold;
+    char *steady_samples;
+    char *burst_frame;
+    char *burst_seconds;
+    char *low_latency;
+    char *reconnect;
+    char *fast_connect;
+    char *d0cache;
   } readmems_config;
 
   char *simple_current_time(void);
@@ -301,17 +1092,103 @@ extern "C"
 
   void mems_init(mems_info *info);
   bool mems_init_link(mems_info *info, uint8_t *d0_response_buffer);
+  bool mems_init_link_fast(mems_info *info, uint8_t *d0_response_buffer, uint32_t probe_ms, bool *resumed);
+  void mems_set_d0_response(mems_info *info, const uint8_t *d0_response);
   void mems_cleanup(mems_info *info);
   bool mems_connect(mems_info *info, const char *devPath);
   void mems_disconnect(mems_info *info);
   bool mems_is_connected(mems_info *info);
   bool mems_read_raw(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d);
   bool mems_read(mems_info *info, mems_data *data);
+  bool mems_read_compact(mems_info *info, mems_compact_sample *sample);
+  void mems_decode_compact(const mems_compact_sample *compact, mems_sample *sample);
+  bool mems_read_lazy(mems_info *info, mems_lazy_data *lazy);
+  void mems_lazy_init(mems_lazy_data *lazy, const mems_compact_sample *sample);
+  const char *mems_lazy_raw80(mems_lazy_data *lazy);
+  const char *mems_lazy_raw7d(mems_lazy_data *lazy);
+  const mems_data *mems_lazy_decode(mems_lazy_data *lazy, uint64_t fields);
+  void mems_decode(const mems_data_frame_80 *frame80, const mems_data_frame_7d *frame7d, mems_data *data);
+  bool mems_burst_init(mems_burst *burst, uint32_t capacity);
+  bool mems_burst_capture(mems_info *info, mems_burst *burst, uint64_t fields, uint32_t duration_ms);
+  void mems_burst_decode(const mems_burst *burst, uint32_t index, mems_data *data);
+  void mems_burst_cleanup(mems_burst *burst);
+  uint32_t mems_burst_decode_columns(const mems_burst *burst, mems_columns *columns);
+  bool mems_columns_init(mems_columns *columns, uint32_t capacity, uint64_t fields);
+  uint32_t mems_decode_batch(const mems_data_frame_80 *frames80, const mems_data_frame_7d *frames7d, uint32_t count, mems_columns *columns);
+  void mems_columns_cleanup(mems_columns *columns);
+  bool mems_calibrate(mems_info *info, uint32_t iterations, bool apply, mems_calibration *result);
+  uint8_t mems_fields_frames(uint64_t fields);
+  uint64_t mems_frames_fields(uint8_t frames);
+  const mems_field_descriptor *mems_describe_field(mems_field field);
+  size_t mems_field_label(mems_field field, char *buffer, size_t size);
+  size_t mems_format_csv_header(uint64_t fields, char *buffer, size_t size);
+  size_t mems_format_csv(const mems_data *data, uint64_t fields, char *buffer, size_t size);
+  bool mems_read_fields(mems_info *info, mems_data *data, uint64_t fields);
+  bool mems_get_latest(mems_info *info, mems_sample *sample);
   bool mems_read_iac_position(mems_info *info, uint8_t *position);
   bool mems_move_iac(mems_info *info, uint8_t desired_pos);
+  bool mems_iac_move(mems_info *info, uint8_t desired_pos, uint16_t extra_steps, uint64_t deadline_us, mems_iac_result *result);
   bool mems_test_actuator(mems_info *info, actuator_cmd cmd, uint8_t *data);
   bool mems_clear_faults(mems_info *info);
   bool mems_heartbeat(mems_info *info);
+  bool mems_set_nonblocking(mems_info *info, bool nonblocking);
+  void mems_set_transport(mems_info *info, const mems_transport *transport);
+  void mems_set_max_retries(mems_info *info, uint8_t retries);
+  void mems_get_link_stats(mems_info *info, mems_link_stats *stats);
+  void mems_ecusim_init(mems_ecusim *ecu, bool engine_running);
+  size_t mems_ecusim_respond(mems_ecusim *ecu, uint8_t cmd, uint8_t *reply);
+  bool mems_set_low_latency(mems_info *info, bool low_latency);
+  void mems_get_serial_latency(mems_info *info, mems_serial_latency *latency);
+  void mems_set_pipelined(mems_info *info, bool pipelined);
+
+  void mems_parser_init(mems_parser *parser);
+  size_t mems_parser_feed(mems_parser *parser, const uint8_t *data, size_t len, uint8_t *command);
+
+#if defined(linux)
+  bool mems_engine_init(mems_engine *engine, mems_engine_callback callback, void *context);
+  int mems_engine_add(mems_engine *engine, mems_info *info);
+  int mems_engine_run_once(mems_engine *engine, int timeout_ms);
+  bool mems_engine_run(mems_engine *engine);
+  void mems_engine_stop(mems_engine *engine);
+  void mems_engine_cleanup(mems_engine *engine);
+#endif
+
+#if !defined(WIN32)
+  bool mems_stream_start(mems_stream *stream, mems_info *info, uint32_t capacity, float rate_hz);
+  bool mems_stream_poll(mems_stream *stream, mems_sample *sample);
+  bool mems_stream_wait(mems_stream *stream, mems_sample *sample, uint32_t timeout_ms);
+  void mems_stream_get_stats(mems_stream *stream, mems_stream_stats *stats);
+  void mems_stream_set_adaptive(mems_stream *stream, mems_adaptive_rate *policy);
+  void mems_stream_set_supervisor(mems_stream *stream, mems_supervisor *supervisor);
+  void mems_stream_stop(mems_stream *stream);
+#endif
+
+  uint64_t mems_monotonic_us(void);
+  uint64_t mems_deadline_ms(uint32_t milliseconds);
+  void mems_scheduler_init(mems_scheduler *sched, float rate_hz);
+  bool mems_scheduler_wait(mems_scheduler *sched);
+  uint64_t mems_scheduler_next_us(const mems_scheduler *sched);
+  void mems_scheduler_set_rate(mems_scheduler *sched, float rate_hz);
+  void mems_scheduler_get_stats(mems_scheduler *sched, mems_scheduler_stats *stats);
+  void mems_adaptive_init(mems_adaptive_rate *policy, float rate_max);
+  float mems_adaptive_update(mems_adaptive_rate *policy, const mems_data *data);
+  float mems_adaptive_update_compact(mems_adaptive_rate *policy, const mems_compact_sample *sample);
+  void mems_supervisor_init(mems_supervisor *supervisor, mems_info *info, const char *port);
+  void mems_supervisor_set_callback(mems_supervisor *supervisor, mems_supervisor_callback callback, void *context);
+  bool mems_supervisor_reconnect(mems_supervisor *supervisor);
+  void mems_supervisor_report(mems_supervisor *supervisor, bool success);
+  bool mems_supervisor_read(mems_supervisor *supervisor, mems_data *data);
+  bool mems_supervisor_read_compact(mems_supervisor *supervisor, mems_compact_sample *sample);
+  void mems_supervisor_idle_until(mems_supervisor *supervisor, uint64_t until_us);
+  bool mems_read_raw_timed(mems_info *info, mems_data_frame_80 *frame80, mems_data_frame_7d *frame7d, uint64_t deadline_us);
+  bool mems_read_timed(mems_info *info, mems_data *data, uint64_t deadline_us);
+  bool mems_read_compact_timed(mems_info *info, mems_compact_sample *sample, uint64_t deadline_us);
+  bool mems_read_lazy_timed(mems_info *info, mems_lazy_data *lazy, uint64_t deadline_us);
+  bool mems_read_fields_timed(mems_info *info, mems_data *data, uint64_t fields, uint64_t deadline_us);
+  bool mems_read_iac_position_timed(mems_info *info, uint8_t *position, uint64_t deadline_us);
+  bool mems_test_actuator_timed(mems_info *info, actuator_cmd cmd, uint8_t *data, uint64_t deadline_us);
+  bool mems_heartbeat_timed(mems_info *info, uint64_t deadline_us);
+  int mems_transact(mems_info *info, mems_command *commands, size_t count, uint64_t deadline_us);
 
   librosco_version mems_get_lib_version();
 
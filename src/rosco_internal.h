@@ -2,14 +2,41 @@
 #define LIBMEMS_INTERNAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+//! Time taken to transfer one byte (8N1) at 9600 baud
+#define MEMS_BYTE_TIME_US 1042
+
+/**
+ * Sleeps until a time on the monotonic clock, as mems_sleep_until() does.
+ * @return False if the sleep was cut short and the caller should stop waiting
+ */
+typedef bool (*mems_sleeper)(uint64_t wake_us, void *arg);
 
 bool mems_openserial(mems_info *info, const char *devPath);
+const mems_transport *mems_transport_for_port(const char *path);
 bool mems_send_command(mems_info *info, uint8_t cmd);
+bool mems_send_command_timed(mems_info *info, uint8_t cmd, uint64_t deadline_us);
+bool mems_send_command_quiet(mems_info *info, uint8_t cmd, uint64_t deadline_us);
 int16_t mems_read_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
+int16_t mems_read_serial_timed(mems_info* info, uint8_t *buffer, uint16_t quantity, uint64_t deadline_us);
+int16_t mems_read_serial_quiet(mems_info* info, uint8_t *buffer, uint16_t quantity, uint64_t deadline_us);
 int16_t mems_write_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
+bool mems_read_frame_locked(mems_info *info, uint8_t cmd, uint8_t *frame, uint16_t size, uint64_t deadline_us);
+bool mems_resync_locked(mems_info *info, uint64_t deadline_us);
+void mems_drain_locked(mems_info *info, uint64_t deadline_us);
+int mems_transact_locked(mems_info *info, mems_command *commands, size_t count, uint64_t deadline_us);
 bool mems_lock(mems_info* info);
 void mems_unlock(mems_info* info);
 uint8_t temperature_value_to_degrees_f(uint8_t val);
+void mems_decode_80(const mems_data_frame_80 *frame80, mems_data *data);
+void mems_decode_7d(const mems_data_frame_7d *frame7d, mems_data *data);
+void mems_sleep_until(uint64_t wake_us);
+bool mems_scheduler_wait_with(mems_scheduler *sched, mems_sleeper sleeper, void *arg);
+void mems_supervisor_idle_with(mems_supervisor *supervisor, uint64_t until_us, mems_sleeper sleeper, void *arg);
+uint32_t mems_decode_columns(const uint8_t *frames80, size_t stride80, const uint8_t *frames7d, size_t stride7d, uint32_t count, mems_columns *columns);
+void mems_publish_latest(mems_info *info, const mems_compact_sample *sample);
+char *mems_format_hex(char *buffer, const uint8_t *bytes, size_t count);
 
 #endif // LIBMEMS_INTERNAL_H
 
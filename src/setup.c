@@ -10,15 +10,21 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #if defined(WIN32)
   #include <windows.h>
 #else
-  #include <string.h>
   #include <termios.h>
   #include <arpa/inet.h>
 #endif
 
+#if defined(linux)
+  #include <stdio.h>
+  #include <sys/ioctl.h>
+  #include <linux/serial.h>
+#endif
+
 #include "rosco.h"
 #include "rosco_internal.h"
 #include "rosco_version.h"
@@ -37,7 +43,21 @@ void mems_init(mems_info *info)
 #else
     info->sd = 0;
     pthread_mutex_init(&info->mutex, NULL);
+    info->nonblocking = false;
 #endif
+    info->read_timeout_ms = MEMS_DEFAULT_READ_TIMEOUT_MS;
+    info->pipelined = false;
+    info->serial_latency.requested = false;
+    info->serial_latency.active = false;
+    info->serial_latency.latency_timer_ms = -1;
+    info->max_retries = MEMS_DEFAULT_MAX_RETRIES;
+    info->d0_cached = false;
+    memset(&info->link_stats, 0, sizeof(mems_link_stats));
+    info->transport = NULL;
+    info->preferred_transport = NULL;
+    info->transport_state = NULL;
+    info->latest_seq = 0;
+    memset(&info->latest, 0, sizeof(mems_compact_sample));
 }
 
 /**
@@ -46,19 +66,14 @@ void mems_init(mems_info *info)
  */
 void mems_cleanup(mems_info *info)
 {
-#if defined(WIN32)
     if (mems_is_connected(info))
     {
-        CloseHandle(info->sd);
-        info->sd = INVALID_HANDLE_VALUE;
+        info->transport->close(info);
     }
+
+#if defined(WIN32)
     CloseHandle(info->mutex);
 #else
-    if (mems_is_connected(info))
-    {
-        close(info->sd);
-        info->sd = 0;
-    }
     pthread_mutex_destroy(&info->mutex);
 #endif
 }
@@ -79,7 +94,7 @@ librosco_version mems_get_lib_version()
 }
 
 /**
- * Closes the serial device.
+ * Closes the connection to the ECU.
  * @param info State information for the current connection.
  */
 void mems_disconnect(mems_info *info)
@@ -89,8 +104,7 @@ void mems_disconnect(mems_info *info)
     {
         if (mems_is_connected(info))
         {
-            CloseHandle(info->sd);
-            info->sd = INVALID_HANDLE_VALUE;
+            info->transport->close(info);
         }
 
         ReleaseMutex(info->mutex);
@@ -100,8 +114,7 @@ void mems_disconnect(mems_info *info)
 
     if (mems_is_connected(info))
     {
-        close(info->sd);
-        info->sd = 0;
+        info->transport->close(info);
     }
 
     pthread_mutex_unlock(&info->mutex);
@@ -109,9 +122,33 @@ void mems_disconnect(mems_info *info)
 }
 
 /**
- * Opens the serial port (or returns with success if it is already open.)
+ * Opens the port with the preferred transport, or the one suited to the
+ * port name.
+ */
+static bool mems_open_transport(mems_info *info, const char *devPath)
+{
+    info->transport = info->preferred_transport ? info->preferred_transport : mems_transport_for_port(devPath);
+
+    return info->transport->open(info, devPath);
+}
+
+/**
+ * Chooses the transport backend for subsequent connections.
+ * @param info State information for the current connection.
+ * @param transport Backend to use (e.g. &mems_transport_loopback), or NULL
+ *   to choose one from the port name passed to mems_connect()
+ */
+void mems_set_transport(mems_info *info, const mems_transport *transport)
+{
+    info->preferred_transport = transport;
+}
+
+/**
+ * Opens the connection to the ECU through the chosen transport (or returns
+ * with success if it is already open.)
  * @param info State information for the current connection.
- * @param devPath Full path to the serial device (e.g. "/dev/ttyUSB0" or "COM2")
+ * @param devPath Full path to the serial device (e.g. "/dev/ttyUSB0" or
+ *   "COM2"), or MEMS_LOOPBACK_PORT for the in-memory simulated ECU
  * @return True if the serial device was successfully opened and its
  *   baud rate was set; false otherwise.
  */
@@ -122,18 +159,107 @@ bool mems_connect(mems_info *info, const char *devPath)
 #if defined(WIN32)
     if (WaitForSingleObject(info->mutex, INFINITE) == WAIT_OBJECT_0)
     {
-        result = mems_is_connected(info) || mems_openserial(info, devPath);
+        result = mems_is_connected(info) || mems_open_transport(info, devPath);
         ReleaseMutex(info->mutex);
     }
 #else // Linux/Unix
     pthread_mutex_lock(&info->mutex);
-    result = mems_is_connected(info) || mems_openserial(info, devPath);
+    result = mems_is_connected(info) || mems_open_transport(info, devPath);
     pthread_mutex_unlock(&info->mutex);
 #endif
 
     return result;
 }
 
+#if !defined(WIN32)
+/**
+ * Reads the latency timer of a USB serial adapter (e.g. FTDI) from sysfs.
+ * @return Latency timer in milliseconds, or -1 if the device has none
+ */
+static int mems_read_latency_timer(int sd)
+{
+    int timer = -1;
+#if defined(linux)
+    char link[32];
+    char device[256];
+    char path[320];
+    const char *name;
+    ssize_t len;
+    FILE *file;
+
+    // find the tty name (e.g. ttyUSB0) through the descriptor, which also
+    // resolves any symlink the device was opened through
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", sd);
+    len = readlink(link, device, sizeof(device) - 1);
+    if (len > 0)
+    {
+        device[len] = 0;
+        name = strrchr(device, '/');
+        name = name ? (name + 1) : device;
+
+        snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", name);
+        file = fopen(path, "r");
+        if (file)
+        {
+            if (fscanf(file, "%d", &timer) != 1)
+            {
+                timer = -1;
+            }
+            fclose(file);
+        }
+    }
+#endif
+    return timer;
+}
+
+/**
+ * Applies the requested low-latency setting to the open serial device and
+ * records the effective settings. Drivers that do not support
+ * ASYNC_LOW_LATENCY are left as they are.
+ */
+static void mems_apply_low_latency(mems_info *info)
+{
+#if defined(linux)
+    struct serial_struct serial;
+
+    // leave the driver alone unless low-latency mode is wanted, or was set
+    // here and is now being turned off
+    if ((info->serial_latency.requested || info->serial_latency.active) &&
+        (ioctl(info->sd, TIOCGSERIAL, &serial) == 0))
+    {
+        if (info->serial_latency.requested)
+        {
+            serial.flags |= ASYNC_LOW_LATENCY;
+        }
+        else
+        {
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+        }
+
+        if (ioctl(info->sd, TIOCSSERIAL, &serial) == 0)
+        {
+            info->serial_latency.active = info->serial_latency.requested;
+        }
+        else if (info->serial_latency.requested)
+        {
+            dprintf_err("mems_openserial(): driver does not support low-latency mode\n");
+        }
+    }
+    else if (info->serial_latency.requested)
+    {
+        dprintf_err("mems_openserial(): device does not support TIOCGSERIAL; low-latency mode unavailable\n");
+    }
+
+    // the FTDI driver drops its latency timer to 1ms in low-latency mode,
+    // so read it back afterwards
+    info->serial_latency.latency_timer_ms = mems_read_latency_timer(info->sd);
+#else
+    info->serial_latency.active = false;
+    info->serial_latency.latency_timer_ms = -1;
+#endif
+}
+#endif
+
 /**
  * Opens the serial device for the USB<->TTL/serial converter and sets the
  * parameters for the link to match those on the MEMS ECU.
@@ -153,7 +279,7 @@ bool mems_openserial(mems_info *info, const char *devPath)
     struct termios newtio;
     bool success = true;
 
-    info->sd = open(devPath, O_RDWR | O_NOCTTY);
+    info->sd = open(devPath, O_RDWR | O_NOCTTY | (info->nonblocking ? O_NONBLOCK : 0));
 
     if (info->sd > 0)
     {
@@ -198,6 +324,11 @@ bool mems_openserial(mems_info *info, const char *devPath)
             }
         }
 
+        if (success)
+        {
+            mems_apply_low_latency(info);
+        }
+
         retVal = success;
 
         // close the device if it couldn't be configured
@@ -260,6 +391,89 @@ bool mems_openserial(mems_info *info, const char *devPath)
     return retVal;
 }
 
+/**
+ * Requests low-latency mode for the serial device, so that the driver (and
+ * USB adapters that honour it) pass each received byte on immediately
+ * rather than buffering it. May be called before or after mems_connect();
+ * see mems_get_serial_latency() for the settings actually in effect.
+ * @param info State information for the current connection.
+ * @param low_latency True to request low-latency mode
+ * @return True if the setting is in effect (or will be applied when the
+ *   device is opened); false if the driver does not support it
+ */
+bool mems_set_low_latency(mems_info *info, bool low_latency)
+{
+    bool result = true;
+
+#if defined(WIN32)
+    info->serial_latency.requested = low_latency;
+    result = !low_latency;
+#else
+    pthread_mutex_lock(&info->mutex);
+
+    info->serial_latency.requested = low_latency;
+
+    if (mems_is_connected(info) && (info->transport == &mems_transport_serial))
+    {
+        mems_apply_low_latency(info);
+        result = (info->serial_latency.active == low_latency);
+    }
+
+    pthread_mutex_unlock(&info->mutex);
+#endif
+
+    return result;
+}
+
+/**
+ * Reports the latency settings in effect for the serial device.
+ * @param info State information for the current connection.
+ * @param latency Receives the settings
+ */
+void mems_get_serial_latency(mems_info *info, mems_serial_latency *latency)
+{
+    memcpy(latency, &info->serial_latency, sizeof(mems_serial_latency));
+}
+
+/**
+ * Selects between blocking reads (which rely on the termios VTIME timer) and
+ * non-blocking reads (which wait on poll() until a deadline computed from the
+ * number of bytes expected). May be called before or after mems_connect().
+ * @param info State information for the current connection.
+ * @param nonblocking True to open/switch the serial device to O_NONBLOCK
+ * @return True if the mode was applied; false if the platform does not
+ *   support non-blocking reads or the descriptor could not be changed.
+ */
+bool mems_set_nonblocking(mems_info *info, bool nonblocking)
+{
+    bool result = false;
+
+#if defined(WIN32)
+    result = !nonblocking;
+#else
+    int flags;
+
+    pthread_mutex_lock(&info->mutex);
+
+    info->nonblocking = nonblocking;
+    result = true;
+
+    if (mems_is_connected(info) && info->transport->has_fd)
+    {
+        flags = fcntl(info->sd, F_GETFL);
+        if (flags >= 0)
+        {
+            flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        }
+        result = (flags >= 0) && (fcntl(info->sd, F_SETFL, flags) == 0);
+    }
+
+    pthread_mutex_unlock(&info->mutex);
+#endif
+
+    return result;
+}
+
 /**
  * Checks the file descriptor for the serial device to determine if it has
  * already been opened.
@@ -267,10 +481,6 @@ bool mems_openserial(mems_info *info, const char *devPath)
  */
 bool mems_is_connected(mems_info* info)
 {
-#if defined(WIN32)
-    return (info->sd != INVALID_HANDLE_VALUE);
-#else
-    return (info->sd > 0);
-#endif
+    return (info->transport != NULL) && info->transport->is_open(info);
 }
 
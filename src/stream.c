@@ -0,0 +1,356 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// stream.c: This file contains a background acquisition thread
+//           that polls the ECU and publishes timestamped samples
+//           into a lock-free single-producer/single-consumer
+//           ring, so that the polling cadence does not depend on
+//           how quickly the consumer formats and logs samples.
+
+#if !defined(WIN32)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Places a sample in the ring. Only the acquisition thread calls this.
+ * @return False if the ring was full and the sample was dropped
+ */
+static bool mems_stream_push(mems_stream *stream, const mems_compact_sample *sample)
+{
+  uint32_t head = __atomic_load_n(&stream->head, __ATOMIC_RELAXED);
+  uint32_t tail = __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE);
+
+  if ((head - tail) == stream->capacity)
+  {
+    __atomic_add_fetch(&stream->overruns, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  memcpy(&stream->ring[head & (stream->capacity - 1)], sample, sizeof(mems_compact_sample));
+  __atomic_store_n(&stream->head, head + 1, __ATOMIC_SEQ_CST);
+
+  // only take the wakeup lock if the consumer is blocked in mems_stream_wait();
+  // the sequentially consistent store/load pair ensures that either the
+  // consumer sees the new head or this thread sees the waiter
+  if (__atomic_load_n(&stream->waiters, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&stream->wake_mutex);
+    pthread_cond_signal(&stream->wake);
+    pthread_mutex_unlock(&stream->wake_mutex);
+  }
+
+  return true;
+}
+
+/**
+ * Sleeps the acquisition thread until the given time on the monotonic
+ * clock, or until the stream is stopped.
+ * @return False if the stream was stopped
+ */
+static bool mems_stream_sleep_until(uint64_t wake_us, void *arg)
+{
+  mems_stream *stream = (mems_stream *)arg;
+  struct timespec deadline;
+  bool running;
+  int rc = 0;
+
+#if defined(__APPLE__)
+  // condition variables cannot wait on the monotonic clock here, so the
+  // wakeup is converted to the realtime clock
+  uint64_t now = mems_monotonic_us();
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  wake_us = ((uint64_t)deadline.tv_sec * 1000000) + (deadline.tv_nsec / 1000) +
+            ((wake_us > now) ? (wake_us - now) : 0);
+#endif
+
+  deadline.tv_sec = wake_us / 1000000;
+  deadline.tv_nsec = (wake_us % 1000000) * 1000;
+
+  pthread_mutex_lock(&stream->stop_mutex);
+  while ((running = __atomic_load_n(&stream->running, __ATOMIC_ACQUIRE)) && (rc == 0))
+  {
+    rc = pthread_cond_timedwait(&stream->stop, &stream->stop_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&stream->stop_mutex);
+
+  return running;
+}
+
+/**
+ * Body of the acquisition thread: reads a sample, publishes it, and waits
+ * for the start of the next polling period.
+ */
+static void *mems_stream_thread(void *arg)
+{
+  mems_stream *stream = (mems_stream *)arg;
+  mems_compact_sample sample;
+  mems_scheduler_stats sched_stats;
+  mems_adaptive_rate *adaptive;
+  mems_supervisor *supervisor;
+  float rate;
+  bool result;
+
+  while (__atomic_load_n(&stream->running, __ATOMIC_ACQUIRE))
+  {
+    supervisor = __atomic_load_n(&stream->supervisor, __ATOMIC_ACQUIRE);
+
+    // wait here rather than in the reconnect's backoff, so that stopping
+    // the stream is not held up while the link is down
+    if (supervisor && !supervisor->up && !mems_stream_sleep_until(supervisor->next_attempt_us, stream))
+    {
+      break;
+    }
+
+    // the frames are left undecoded until the consumer takes them
+    if (supervisor)
+    {
+      result = mems_supervisor_read_compact(supervisor, &sample);
+    }
+    else
+    {
+      result = mems_read_compact(stream->info, &sample);
+    }
+
+    if (result)
+    {
+      __atomic_add_fetch(&stream->samples, 1, __ATOMIC_RELAXED);
+      mems_stream_push(stream, &sample);
+
+      adaptive = __atomic_load_n(&stream->adaptive, __ATOMIC_ACQUIRE);
+      if (adaptive)
+      {
+        rate = adaptive->rate;
+        if (mems_adaptive_update_compact(adaptive, &sample) != rate)
+        {
+          mems_scheduler_set_rate(&stream->sched, adaptive->rate);
+          __atomic_add_fetch(&stream->rate_changes, 1, __ATOMIC_RELAXED);
+        }
+      }
+    }
+    else
+    {
+      __atomic_add_fetch(&stream->read_errors, 1, __ATOMIC_RELAXED);
+    }
+
+    // reconnect or keep the session warm while waiting for the next period
+    // (reloaded, as a supervisor set just after starting should cover the
+    // first period too); both waits end early if the stream is stopped
+    supervisor = __atomic_load_n(&stream->supervisor, __ATOMIC_ACQUIRE);
+    if (supervisor)
+    {
+      mems_supervisor_idle_with(supervisor, mems_scheduler_next_us(&stream->sched), mems_stream_sleep_until, stream);
+    }
+
+    mems_scheduler_wait_with(&stream->sched, mems_stream_sleep_until, stream);
+
+    mems_scheduler_get_stats(&stream->sched, &sched_stats);
+    __atomic_store_n(&stream->missed, sched_stats.missed, __ATOMIC_RELAXED);
+    __atomic_store_n(&stream->jitter_mean_us, sched_stats.jitter_mean_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&stream->jitter_max_us, sched_stats.jitter_max_us, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts polling the ECU on a dedicated thread. The connection must already
+ * be open and initialised with mems_init_link().
+ * @param stream Stream state
+ * @param info Connection to poll
+ * @param capacity Number of samples the ring can hold before samples are
+ *   dropped (rounded up to a power of two)
+ * @param rate_hz Number of reads to start per second, or 0 to poll as fast
+ *   as the link allows
+ * @return True if the thread was started
+ */
+bool mems_stream_start(mems_stream *stream, mems_info *info, uint32_t capacity, float rate_hz)
+{
+  pthread_condattr_t attr;
+
+  memset(stream, 0, sizeof(mems_stream));
+
+  stream->info = info;
+  mems_scheduler_init(&stream->sched, rate_hz);
+  stream->capacity = 1;
+  while (stream->capacity < capacity)
+  {
+    stream->capacity <<= 1;
+  }
+
+  stream->ring = (mems_compact_sample *)malloc(stream->capacity * sizeof(mems_compact_sample));
+  if (stream->ring == NULL)
+  {
+    return false;
+  }
+
+  pthread_mutex_init(&stream->wake_mutex, NULL);
+  pthread_cond_init(&stream->wake, NULL);
+
+  // the acquisition thread's wakeups are times on the monotonic clock
+  pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_mutex_init(&stream->stop_mutex, NULL);
+  pthread_cond_init(&stream->stop, &attr);
+  pthread_condattr_destroy(&attr);
+
+  stream->running = true;
+  if (pthread_create(&stream->thread, NULL, mems_stream_thread, stream) != 0)
+  {
+    stream->running = false;
+    pthread_cond_destroy(&stream->stop);
+    pthread_mutex_destroy(&stream->stop_mutex);
+    pthread_cond_destroy(&stream->wake);
+    pthread_mutex_destroy(&stream->wake_mutex);
+    free(stream->ring);
+    stream->ring = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Takes the oldest unread sample from the ring without blocking, and
+ * decodes it. Must only be called from one consumer thread.
+ * @param stream Stream state
+ * @param sample Receives the sample
+ * @return True if a sample was available
+ */
+bool mems_stream_poll(mems_stream *stream, mems_sample *sample)
+{
+  mems_compact_sample compact;
+  uint32_t tail = __atomic_load_n(&stream->tail, __ATOMIC_RELAXED);
+  uint32_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+  {
+    return false;
+  }
+
+  // release the slot before decoding, so the producer is not held up
+  memcpy(&compact, &stream->ring[tail & (stream->capacity - 1)], sizeof(mems_compact_sample));
+  __atomic_store_n(&stream->tail, tail + 1, __ATOMIC_RELEASE);
+
+  mems_decode_compact(&compact, sample);
+
+  return true;
+}
+
+/**
+ * Takes the oldest unread sample from the ring, waiting for one to be
+ * published if the ring is empty.
+ * @param stream Stream state
+ * @param sample Receives the sample
+ * @param timeout_ms Longest time to wait
+ * @return True if a sample was available before the timeout
+ */
+bool mems_stream_wait(mems_stream *stream, mems_sample *sample, uint32_t timeout_ms)
+{
+  struct timespec deadline;
+  bool result;
+  int rc = 0;
+
+  if (mems_stream_poll(stream, sample))
+  {
+    return true;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&stream->wake_mutex);
+  __atomic_add_fetch(&stream->waiters, 1, __ATOMIC_SEQ_CST);
+  while (!(result = mems_stream_poll(stream, sample)) && (rc != ETIMEDOUT))
+  {
+    rc = pthread_cond_timedwait(&stream->wake, &stream->wake_mutex, &deadline);
+  }
+  __atomic_sub_fetch(&stream->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&stream->wake_mutex);
+
+  return result;
+}
+
+/**
+ * Copies the acquisition counters.
+ * @param stream Stream state
+ * @param stats Receives the counters
+ */
+void mems_stream_get_stats(mems_stream *stream, mems_stream_stats *stats)
+{
+  stats->samples = __atomic_load_n(&stream->samples, __ATOMIC_RELAXED);
+  stats->overruns = __atomic_load_n(&stream->overruns, __ATOMIC_RELAXED);
+  stats->read_errors = __atomic_load_n(&stream->read_errors, __ATOMIC_RELAXED);
+  stats->missed = __atomic_load_n(&stream->missed, __ATOMIC_RELAXED);
+  stats->jitter_mean_us = __atomic_load_n(&stream->jitter_mean_us, __ATOMIC_RELAXED);
+  stats->jitter_max_us = __atomic_load_n(&stream->jitter_max_us, __ATOMIC_RELAXED);
+  stats->rate_changes = __atomic_load_n(&stream->rate_changes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lets a polling policy adjust the stream's rate after each sample. From
+ * this call on, the policy is updated only by the acquisition thread, and
+ * it must remain valid until the stream is stopped.
+ * @param stream Stream state
+ * @param policy Policy initialised with mems_adaptive_init(), or NULL to
+ *   keep the current rate
+ */
+void mems_stream_set_adaptive(mems_stream *stream, mems_adaptive_rate *policy)
+{
+  __atomic_store_n(&stream->adaptive, policy, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lets a supervisor reconnect the link if it is lost, and send heartbeats
+ * between reads that are far apart. From this call on, the supervisor is
+ * used only by the acquisition thread; its counters may be read once the
+ * stream is stopped.
+ * @param stream Stream state
+ * @param supervisor Supervisor initialised with mems_supervisor_init() for
+ *   the stream's connection, or NULL to read the connection directly
+ */
+void mems_stream_set_supervisor(mems_stream *stream, mems_supervisor *supervisor)
+{
+  __atomic_store_n(&stream->supervisor, supervisor, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stops the acquisition thread and releases the ring. A thread waiting for
+ * its next polling period is woken, so this returns once any read in
+ * progress has finished. Unread samples are discarded.
+ * @param stream Stream state
+ */
+void mems_stream_stop(mems_stream *stream)
+{
+  if (stream->ring)
+  {
+    pthread_mutex_lock(&stream->stop_mutex);
+    __atomic_store_n(&stream->running, false, __ATOMIC_RELEASE);
+    pthread_cond_signal(&stream->stop);
+    pthread_mutex_unlock(&stream->stop_mutex);
+
+    pthread_join(stream->thread, NULL);
+
+    pthread_cond_destroy(&stream->stop);
+    pthread_mutex_destroy(&stream->stop_mutex);
+    pthread_cond_destroy(&stream->wake);
+    pthread_mutex_destroy(&stream->wake_mutex);
+    free(stream->ring);
+    stream->ring = NULL;
+  }
+}
+
+#endif // !WIN32
@@ -0,0 +1,285 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// supervisor.c: This file contains a supervisor that keeps a link
+//               to the ECU alive across ignition cycles and adapter
+//               glitches: it detects a lost link, reconnects with
+//               jittered exponential backoff, and keeps the ECU's
+//               diagnostic session warm with heartbeats while idle.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! A heartbeat is only sent in an idle gap if at least this much of the
+//! gap would remain for its reply
+#define MEMS_SUPERVISOR_HEARTBEAT_SLACK_US 50000
+
+/**
+ * Spreads a reconnect delay over its upper half, so that several clients
+ * (or a client and a flapping adapter) do not retry in lock-step.
+ */
+static uint32_t mems_supervisor_jitter(mems_supervisor *supervisor, uint32_t delay_ms)
+{
+  // xorshift32
+  supervisor->random ^= supervisor->random << 13;
+  supervisor->random ^= supervisor->random >> 17;
+  supervisor->random ^= supervisor->random << 5;
+
+  return (delay_ms / 2) + (supervisor->random % ((delay_ms / 2) + 1));
+}
+
+/**
+ * Marks the link as lost. The first reconnect is attempted at once, as most
+ * outages (e.g. the ignition being cycled) are over by the time they are
+ * noticed.
+ */
+static void mems_supervisor_lost(mems_supervisor *supervisor)
+{
+  uint64_t now = mems_monotonic_us();
+
+  supervisor->up = false;
+  supervisor->losses += 1;
+  supervisor->lost_us = now;
+  supervisor->backoff_ms = supervisor->backoff_min_ms;
+  supervisor->next_attempt_us = now;
+
+  dprintf_err("mems_supervisor: link to %s lost after %u failures\n", supervisor->port, supervisor->consecutive_failures);
+
+  if (supervisor->callback)
+  {
+    supervisor->callback(supervisor->context, false);
+  }
+}
+
+/**
+ * Prepares a supervisor for a connection. If the connection is already open
+ * it is assumed to be initialised; otherwise the first call to
+ * mems_supervisor_read() or mems_supervisor_reconnect() opens it.
+ * @param supervisor Supervisor state
+ * @param info Connection to supervise
+ * @param port Port name to pass to mems_connect() when reconnecting
+ */
+void mems_supervisor_init(mems_supervisor *supervisor, mems_info *info, const char *port)
+{
+  memset(supervisor, 0, sizeof(mems_supervisor));
+
+  supervisor->info = info;
+  strncpy(supervisor->port, port, sizeof(supervisor->port) - 1);
+  supervisor->backoff_min_ms = MEMS_SUPERVISOR_DEFAULT_BACKOFF_MIN_MS;
+  supervisor->backoff_max_ms = MEMS_SUPERVISOR_DEFAULT_BACKOFF_MAX_MS;
+  supervisor->heartbeat_ms = MEMS_SUPERVISOR_DEFAULT_HEARTBEAT_MS;
+  supervisor->failure_limit = MEMS_SUPERVISOR_DEFAULT_FAILURE_LIMIT;
+  supervisor->backoff_ms = supervisor->backoff_min_ms;
+  supervisor->up = mems_is_connected(info);
+  supervisor->last_activity_us = mems_monotonic_us();
+  supervisor->next_attempt_us = supervisor->last_activity_us;
+  supervisor->random = (uint32_t)supervisor->last_activity_us | 1;
+}
+
+/**
+ * Sets a function to be told when the link is lost and when it is back.
+ * The function is called on the thread using the supervisor.
+ * @param supervisor Supervisor state
+ * @param callback Function to call, or NULL for none
+ * @param context Passed unchanged to the callback
+ */
+void mems_supervisor_set_callback(mems_supervisor *supervisor, mems_supervisor_callback callback, void *context)
+{
+  supervisor->callback = callback;
+  supervisor->context = context;
+}
+
+/**
+ * Makes one attempt to bring a lost link back, waiting first until the
+ * backoff delay since the last attempt has passed. The port is closed and
+ * reopened, so a USB adapter that has been unplugged and replugged is picked
+ * up again, and the initialisation sequence is repeated unless the ECU's
+ * session survived the outage.
+ * @param supervisor Supervisor state
+ * @return True if the link is up
+ */
+bool mems_supervisor_reconnect(mems_supervisor *supervisor)
+{
+  uint8_t d0_response[4];
+
+  if (supervisor->up)
+  {
+    return true;
+  }
+
+  mems_sleep_until(supervisor->next_attempt_us);
+  supervisor->attempts += 1;
+
+  mems_disconnect(supervisor->info);
+  if (mems_connect(supervisor->info, supervisor->port) &&
+      mems_init_link_fast(supervisor->info, d0_response, MEMS_DEFAULT_PROBE_MS, NULL))
+  {
+    supervisor->up = true;
+    supervisor->consecutive_failures = 0;
+    supervisor->reconnects += 1;
+    supervisor->backoff_ms = supervisor->backoff_min_ms;
+    supervisor->last_activity_us = mems_monotonic_us();
+
+    if (supervisor->callback)
+    {
+      supervisor->callback(supervisor->context, true);
+    }
+  }
+  else
+  {
+    supervisor->next_attempt_us = mems_monotonic_us() +
+                                  ((uint64_t)mems_supervisor_jitter(supervisor, supervisor->backoff_ms) * 1000);
+
+    supervisor->backoff_ms *= 2;
+    if (supervisor->backoff_ms > supervisor->backoff_max_ms)
+    {
+      supervisor->backoff_ms = supervisor->backoff_max_ms;
+    }
+  }
+
+  return supervisor->up;
+}
+
+/**
+ * Records the outcome of an exchange made on the supervised connection.
+ * Several consecutive failures, or the port being closed, mark the link as
+ * lost.
+ * @param supervisor Supervisor state
+ * @param success True if the ECU replied
+ */
+void mems_supervisor_report(mems_supervisor *supervisor, bool success)
+{
+  if (success)
+  {
+    supervisor->consecutive_failures = 0;
+    supervisor->last_activity_us = mems_monotonic_us();
+
+    if (supervisor->lost_us)
+    {
+      supervisor->last_outage_us = supervisor->last_activity_us - supervisor->lost_us;
+      supervisor->lost_us = 0;
+    }
+  }
+  else
+  {
+    supervisor->consecutive_failures += 1;
+
+    if (supervisor->up &&
+        ((supervisor->consecutive_failures >= supervisor->failure_limit) ||
+         !mems_is_connected(supervisor->info)))
+    {
+      mems_supervisor_lost(supervisor);
+    }
+  }
+}
+
+/**
+ * Reads a sample as mems_read() does, reconnecting first if the link has
+ * been lost. While the link is down, each call makes one reconnect attempt
+ * (after the backoff delay) rather than failing at once.
+ * @param supervisor Supervisor state
+ * @param data Receives the decoded sample
+ * @return True if a sample was read
+ */
+bool mems_supervisor_read(mems_supervisor *supervisor, mems_data *data)
+{
+  mems_compact_sample sample;
+
+  if (!mems_supervisor_read_compact(supervisor, &sample))
+  {
+    return false;
+  }
+
+  mems_decode(&sample.frame80, &sample.frame7d, data);
+
+  return true;
+}
+
+/**
+ * Reads a sample as mems_read_compact() does, reconnecting first if the
+ * link has been lost (see mems_supervisor_read()).
+ * @param supervisor Supervisor state
+ * @param sample Receives the raw frames
+ * @return True if a sample was read
+ */
+bool mems_supervisor_read_compact(mems_supervisor *supervisor, mems_compact_sample *sample)
+{
+  bool result;
+
+  if (!mems_supervisor_reconnect(supervisor))
+  {
+    return false;
+  }
+
+  result = mems_read_compact(supervisor->info, sample);
+  mems_supervisor_report(supervisor, result);
+
+  return result;
+}
+
+/**
+ * Uses a gap between reads: if the link is down, reconnect attempts that
+ * fall due before the end of the gap are made; if it is up and has been
+ * idle for heartbeat_ms, heartbeats are sent so that the ECU does not end
+ * the diagnostic session. Returns early if there is nothing left to do, so
+ * the caller should still wait for the end of the gap itself.
+ * @param supervisor Supervisor state
+ * @param until_us End of the gap, from mems_monotonic_us()
+ */
+void mems_supervisor_idle_until(mems_supervisor *supervisor, uint64_t until_us)
+{
+  mems_supervisor_idle_with(supervisor, until_us, NULL, NULL);
+}
+
+/**
+ * Uses a gap between reads as mems_supervisor_idle_until() does, sleeping
+ * with the given function so that another thread can cut the gap short.
+ * @param supervisor Supervisor state
+ * @param until_us End of the gap, from mems_monotonic_us()
+ * @param sleeper Sleeps until a reconnect attempt or heartbeat falls due,
+ *   or NULL to sleep with mems_sleep_until()
+ * @param arg Passed unchanged to the sleeper
+ */
+void mems_supervisor_idle_with(mems_supervisor *supervisor, uint64_t until_us, mems_sleeper sleeper, void *arg)
+{
+  uint64_t heartbeat_us;
+  bool result;
+
+  while (mems_monotonic_us() < until_us)
+  {
+    if (!supervisor->up)
+    {
+      if ((supervisor->next_attempt_us >= until_us) ||
+          ((sleeper != NULL) && !sleeper(supervisor->next_attempt_us, arg)))
+      {
+        break;
+      }
+
+      mems_supervisor_reconnect(supervisor);
+    }
+    else
+    {
+      heartbeat_us = supervisor->last_activity_us + ((uint64_t)supervisor->heartbeat_ms * 1000);
+
+      if ((supervisor->heartbeat_ms == 0) ||
+          ((heartbeat_us + MEMS_SUPERVISOR_HEARTBEAT_SLACK_US) >= until_us))
+      {
+        break;
+      }
+
+      if (sleeper == NULL)
+      {
+        mems_sleep_until(heartbeat_us);
+      }
+      else if (!sleeper(heartbeat_us, arg))
+      {
+        break;
+      }
+
+      supervisor->heartbeats += 1;
+      result = mems_heartbeat_timed(supervisor->info, until_us);
+      mems_supervisor_report(supervisor, result);
+    }
+  }
+}
@@ -0,0 +1,213 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// timing.c: This file contains the monotonic clock used to
+//           compute deadlines for serial I/O, and the fixed-rate
+//           scheduler used to pace periodic reads.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Reads a clock that is unaffected by changes to the system time.
+ * @return Microseconds elapsed since an arbitrary, fixed point in the past
+ */
+uint64_t mems_monotonic_us(void)
+{
+#if defined(WIN32)
+  LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+
+  return ((uint64_t)(count.QuadPart / freq.QuadPart) * 1000000) +
+         ((uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+/**
+ * Computes a deadline for the _timed functions.
+ * @param milliseconds Time from now until the deadline
+ * @return Absolute deadline in the same units as mems_monotonic_us()
+ */
+uint64_t mems_deadline_ms(uint32_t milliseconds)
+{
+  return mems_monotonic_us() + ((uint64_t)milliseconds * 1000);
+}
+
+/**
+ * Prepares a scheduler that paces a loop at a fixed rate. The first call to
+ * mems_scheduler_wait() returns one period after this call.
+ * @param sched Scheduler state
+ * @param rate_hz Target number of iterations per second, or 0 to run as fast
+ *   as possible
+ */
+void mems_scheduler_init(mems_scheduler *sched, float rate_hz)
+{
+  memset(sched, 0, sizeof(mems_scheduler));
+
+  mems_scheduler_set_rate(sched, rate_hz);
+  sched->next_us = mems_monotonic_us();
+}
+
+/**
+ * Sleeps until the given time on the monotonic clock.
+ */
+void mems_sleep_until(uint64_t wake_us)
+{
+#if defined(WIN32)
+  uint64_t now = mems_monotonic_us();
+
+  if (wake_us > now)
+  {
+    Sleep((DWORD)((wake_us - now + 999) / 1000));
+  }
+#elif defined(__APPLE__)
+  struct timespec ts;
+  uint64_t now = mems_monotonic_us();
+
+  // no absolute sleep here; a late wakeup is still measured as jitter
+  while (wake_us > now)
+  {
+    ts.tv_sec = (wake_us - now) / 1000000;
+    ts.tv_nsec = ((wake_us - now) % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+    now = mems_monotonic_us();
+  }
+#else
+  struct timespec ts;
+
+  ts.tv_sec = wake_us / 1000000;
+  ts.tv_nsec = (wake_us % 1000000) * 1000;
+
+  // an absolute wakeup time means that interruptions and the time spent
+  // between iterations cannot accumulate as drift
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+  {
+  }
+#endif
+}
+
+/**
+ * Waits for the start of the next period. Periods are fixed to the time
+ * the scheduler was initialised, so the time spent in each iteration does
+ * not shift later ones. If an iteration overruns one or more periods, those
+ * periods are counted as missed and skipped, rather than run back-to-back,
+ * so that iterations stay evenly spaced.
+ * @param sched Scheduler state
+ * @return False if one or more periods were missed before this one
+ */
+bool mems_scheduler_wait(mems_scheduler *sched)
+{
+  return mems_scheduler_wait_with(sched, NULL, NULL);
+}
+
+/**
+ * Waits for the start of the next period as mems_scheduler_wait() does,
+ * sleeping with the given function so that another thread can cut the wait
+ * short.
+ * @param sched Scheduler state
+ * @param sleeper Sleeps until the start of the period, or NULL to sleep
+ *   with mems_sleep_until()
+ * @param arg Passed unchanged to the sleeper
+ * @return False if one or more periods were missed before this one, or
+ *   the sleep was cut short
+ */
+bool mems_scheduler_wait_with(mems_scheduler *sched, mems_sleeper sleeper, void *arg)
+{
+  uint64_t now = mems_monotonic_us();
+  uint64_t late;
+  uint32_t missed = 0;
+
+  sched->ticks += 1;
+
+  if (sched->period_us == 0)
+  {
+    sched->next_us = now;
+    return true;
+  }
+
+  sched->next_us += sched->period_us;
+
+  if (now >= sched->next_us)
+  {
+    missed = (uint32_t)((now - sched->next_us) / sched->period_us) + 1;
+    sched->next_us += (uint64_t)missed * sched->period_us;
+    sched->missed += missed;
+  }
+
+  if (sleeper == NULL)
+  {
+    mems_sleep_until(sched->next_us);
+  }
+  else if (!sleeper(sched->next_us, arg))
+  {
+    return false;
+  }
+
+  now = mems_monotonic_us();
+  late = (now > sched->next_us) ? (now - sched->next_us) : 0;
+  sched->jitter_total_us += late;
+  if (late > sched->jitter_max_us)
+  {
+    sched->jitter_max_us = late;
+  }
+
+  return (missed == 0);
+}
+
+/**
+ * Gives the time at which the next call to mems_scheduler_wait() will return,
+ * unless the current iteration overruns it.
+ * @param sched Scheduler state
+ * @return Time of the next wakeup, from mems_monotonic_us()
+ */
+uint64_t mems_scheduler_next_us(const mems_scheduler *sched)
+{
+  return sched->next_us + sched->period_us;
+}
+
+/**
+ * Changes the rate of a running scheduler. The next wakeup is one new
+ * period after the previous one.
+ * @param sched Scheduler state
+ * @param rate_hz Target number of iterations per second, or 0 to run as fast
+ *   as possible
+ */
+void mems_scheduler_set_rate(mems_scheduler *sched, float rate_hz)
+{
+  sched->period_us = (rate_hz > 0) ? (uint64_t)(1000000.0 / rate_hz) : 0;
+}
+
+/**
+ * Copies the scheduler counters.
+ * @param sched Scheduler state
+ * @param stats Receives the counters
+ */
+void mems_scheduler_get_stats(mems_scheduler *sched, mems_scheduler_stats *stats)
+{
+  stats->ticks = sched->ticks;
+  stats->missed = sched->missed;
+  stats->jitter_max_us = (uint32_t)sched->jitter_max_us;
+  stats->jitter_mean_us = sched->ticks ? (uint32_t)(sched->jitter_total_us / sched->ticks) : 0;
+}
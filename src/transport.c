@@ -0,0 +1,220 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// transport.c: This file contains the transport backends that
+//              reach the ECU through a device: a termios serial
+//              port, or a pseudo-terminal (e.g. mems-sim).
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#if defined(linux)
+// ppoll(), cfmakeraw()
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Closes the device.
+ */
+static void mems_device_close(mems_info *info)
+{
+#if defined(WIN32)
+  CloseHandle(info->sd);
+  info->sd = INVALID_HANDLE_VALUE;
+#else
+  close(info->sd);
+  info->sd = 0;
+#endif
+}
+
+/**
+ * Checks whether the device has been opened.
+ */
+static bool mems_device_is_open(mems_info *info)
+{
+#if defined(WIN32)
+  return (info->sd != INVALID_HANDLE_VALUE);
+#else
+  return (info->sd > 0);
+#endif
+}
+
+/**
+ * Reads from the device with a single OS call.
+ */
+static int16_t mems_device_read(mems_info *info, uint8_t *buffer, uint16_t quantity)
+{
+#if defined(WIN32)
+  DWORD w32BytesRead = 0;
+
+  if (ReadFile(info->sd, (UCHAR *)buffer, quantity, &w32BytesRead, NULL) == TRUE)
+  {
+    return (int16_t)w32BytesRead;
+  }
+  return -1;
+#else
+  return (int16_t)read(info->sd, buffer, quantity);
+#endif
+}
+
+/**
+ * Writes to the device with a single OS call.
+ */
+static int16_t mems_device_write(mems_info *info, const uint8_t *buffer, uint16_t quantity)
+{
+#if defined(WIN32)
+  DWORD w32BytesWritten = 0;
+
+  if ((WriteFile(info->sd, (UCHAR *)buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
+      (w32BytesWritten == quantity))
+  {
+    return (int16_t)w32BytesWritten;
+  }
+  return -1;
+#else
+  return (int16_t)write(info->sd, buffer, quantity);
+#endif
+}
+
+/**
+ * Waits for the device to become readable.
+ * @param timeout_us Maximum time to wait, in microseconds
+ * @return True if data is waiting to be read; false on timeout or error
+ */
+static bool mems_device_wait_readable(mems_info *info, uint64_t timeout_us)
+{
+#if defined(WIN32)
+  // ReadFile() waits on the port's own timeouts
+  return true;
+#else
+  struct pollfd pfd;
+  int ready;
+
+  pfd.fd = info->sd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+#if defined(linux)
+  struct timespec ts;
+
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  ready = ppoll(&pfd, 1, &ts, NULL);
+#else
+  // round up so that a short remainder doesn't become a zero-length poll
+  ready = poll(&pfd, 1, (int)((timeout_us + 999) / 1000));
+#endif
+
+  return (ready > 0) && (pfd.revents & POLLIN);
+#endif
+}
+
+/**
+ * Discards anything received by the device but not yet read.
+ */
+static void mems_device_flush(mems_info *info)
+{
+#if defined(WIN32)
+  PurgeComm(info->sd, PURGE_RXCLEAR);
+#else
+  tcflush(info->sd, TCIFLUSH);
+#endif
+}
+
+const mems_transport mems_transport_serial = {
+    "serial",
+    mems_openserial,
+    mems_device_close,
+    mems_device_is_open,
+    mems_device_read,
+    mems_device_write,
+    mems_device_wait_readable,
+    mems_device_flush,
+    true};
+
+#if !defined(WIN32)
+/**
+ * Opens a pseudo-terminal in raw mode. Unlike a serial port, a pty has no
+ * baud rate or driver latency settings to configure.
+ */
+static bool mems_openpty(mems_info *info, const char *path)
+{
+  struct termios tio;
+
+  info->sd = open(path, O_RDWR | O_NOCTTY | (info->nonblocking ? O_NONBLOCK : 0));
+
+  if (info->sd > 0)
+  {
+    if (tcgetattr(info->sd, &tio) == 0)
+    {
+      cfmakeraw(&tio);
+      tio.c_cc[VTIME] = 1;
+      tio.c_cc[VMIN] = 0;
+
+      if ((tcflush(info->sd, TCIFLUSH) == 0) &&
+          (tcsetattr(info->sd, TCSANOW, &tio) == 0))
+      {
+        return true;
+      }
+    }
+
+    close(info->sd);
+    info->sd = 0;
+  }
+
+  return false;
+}
+
+const mems_transport mems_transport_pty = {
+    "pty",
+    mems_openpty,
+    mems_device_close,
+    mems_device_is_open,
+    mems_device_read,
+    mems_device_write,
+    mems_device_wait_readable,
+    mems_device_flush,
+    true};
+#endif
+
+/**
+ * Chooses the backend for a port name: the loopback ECU for
+ * MEMS_LOOPBACK_PORT, a pty for pseudo-terminal devices (Linux), and
+ * otherwise a serial port.
+ */
+const mems_transport *mems_transport_for_port(const char *path)
+{
+#if defined(linux)
+  char resolved[256];
+#endif
+
+  if (strcmp(path, MEMS_LOOPBACK_PORT) == 0)
+  {
+    return &mems_transport_loopback;
+  }
+
+#if defined(linux)
+  if ((realpath(path, resolved) != NULL) && (strncmp(resolved, "/dev/pts/", 9) == 0))
+  {
+    return &mems_transport_pty;
+  }
+#endif
+
+  return &mems_transport_serial;
+}